@@ -12,7 +12,99 @@
 #ifndef DEFINES_H_
 #define DEFINES_H_
 
+#include <linux/ioctl.h>
+
 // Flag that triggers the session semantics when used in the open flag field
 #define O_SESSION 040
 
+// Session hints, carried by the open mode in the bits above the permission bits (07777). The
+// original open ignores them, since it keeps only the permission bits of the mode
+#define SESSION_HINT_NODE_SHIFT 16
+#define SESSION_HINT_NODE_MASK (0xff << SESSION_HINT_NODE_SHIFT)
+// Allocates the session buffer on the given NUMA node
+#define SESSION_HINT_NODE(node) (((node) + 1) << SESSION_HINT_NODE_SHIFT)
+// Waits for a free session slot instead of failing with EMFILE when all the sessions are in use
+#define SESSION_HINT_WAIT (1 << 24)
+// Read only intent: the session buffer is sized on the file, writes fail and nothing is written back
+#define SESSION_HINT_RDONLY (1 << 25)
+// Sequential access: the whole file is read ahead before being copied in the session buffer
+#define SESSION_HINT_SEQUENTIAL (1 << 26)
+// Expected size of the session file, as an order of pages: the session buffer starts with this size
+// instead of the default one, and grows on demand up to the maximum size
+#define SESSION_HINT_SIZE_SHIFT 27
+#define SESSION_HINT_SIZE_MASK (0x7 << SESSION_HINT_SIZE_SHIFT)
+#define SESSION_HINT_SIZE_ORDER(order) (((order) + 1) << SESSION_HINT_SIZE_SHIFT)
+// Commits bypassing the page cache: the written range is flushed to the disk and dropped from the page cache
+#define SESSION_HINT_NOCACHE (1 << 30)
+// Defers the copy-in: the reads are served from the page cache until the session writes or someone is about to
+// change the file, by opening it for writing or changing its size, and only then the file contents are copied
+// in the session buffer. Honoured on the ftrace build only, which sees every writer: the system call table
+// build can't see the writers inside the kernel, and copies in at open
+#define SESSION_HINT_DEFER (1 << 15)
+
+// Session control ioctls, issued on a session file descriptor
+#define SESSION_IOC_MAGIC 'S'
+// Writes back the session buffer to the file, the session goes on
+#define SESSION_IOC_COMMIT _IO(SESSION_IOC_MAGIC, 1)
+// Discards the session: nothing is written back on close, and a later SESSION_IOC_COMMIT fails with ECANCELED
+#define SESSION_IOC_ABORT _IO(SESSION_IOC_MAGIC, 2)
+// Reloads the session buffer from the file, dropping the changes not committed
+#define SESSION_IOC_REFRESH _IO(SESSION_IOC_MAGIC, 3)
+// Joins the session to the group of the session whose file descriptor is given as argument. The sessions
+// of a group are written back together, when the group is committed or when the last of them is closed
+#define SESSION_IOC_JOIN _IOW(SESSION_IOC_MAGIC, 4, int)
+// Writes back together every session of the group, the sessions go on. The files end up all written or none:
+// through the journal even across a crash, without it by writing back the previous contents on a failure
+#define SESSION_IOC_GROUP_COMMIT _IO(SESSION_IOC_MAGIC, 5)
+// Makes every write back of the session check that the file has not changed since the session copied it in.
+// If it has, the write back fails with ESTALE and writes nothing, and the close of the session fails with ESTALE
+#define SESSION_IOC_CHECKED _IO(SESSION_IOC_MAGIC, 6)
+
+// Session operations recorded by the trace capture
+#define SESSION_TRACE_OPEN 1 // offset: file size, size: open flags, mode: open mode
+#define SESSION_TRACE_READ 2 // offset: file position, size: requested bytes
+#define SESSION_TRACE_WRITE 3 // offset: file position, size: requested bytes
+#define SESSION_TRACE_LLSEEK 4 // offset: seek offset, size: origin
+#define SESSION_TRACE_FLUSH 5 // Close of a descriptor of the session
+#define SESSION_TRACE_RELEASE 6 // Last close of the session
+
+// Event of the trace capture, as drained from /sys/kernel/debug/session/trace
+struct sessionTraceEvent {
+	unsigned long long timestamp; // Nanoseconds, from the clock of the recording CPU
+	unsigned long long session; // Identifier of the session, never reused
+	long long offset; // Offset of the operation
+	unsigned int size; // Size of the operation
+	unsigned int mode; // Open mode
+	int pid; // Thread issuing the operation
+	unsigned short type; // One of SESSION_TRACE_*
+	unsigned short cpu; // CPU recording the event
+};
+
+// System call number of the batched session open (takes the slot of the unused gtty syscall)
+#define __NR_sessionOpenBatch 32
+
+// Maximum number of files that can be opened by a single batched session open
+#define SESSION_BATCH_MAX 256
+
+// Entry of a batched session open, the fd field is filled in by the module
+struct sessionOpenRequest {
+	const char *pathname; // Path of the file to open
+	int flags; // Open flags, O_SESSION is always implied
+	int mode; // Open mode, meaningful only with O_CREAT
+	int fd; // Resulting file descriptor
+};
+
+// Control device of the ftrace build, where no syscall can be added: the batched session open is issued
+// on it as an ioctl
+#define SESSION_CONTROL_DEVICE "/dev/session"
+
+// Argument of the batched session open ioctl
+struct sessionBatchRequest {
+	struct sessionOpenRequest *requests; // Requests, as given to the batched session open syscall
+	int count; // Number of entries in requests
+};
+
+// Batched session open, issued on the control device. Same semantics as the batched session open syscall
+#define SESSION_IOC_OPEN_BATCH _IOW(SESSION_IOC_MAGIC, 7, struct sessionBatchRequest)
+
 #endif /* DEFINES_H_ */
@@ -10,32 +10,98 @@
  */
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
 #include "sessionsyscall.h"
+#include "sessionFileOperations.h"
 
 MODULE_LICENSE("GPL");
 
 static int maxSession = -1;
 static int bufferOrder = -1;
+static int bufferPolicy = -1;
+static int poolSize = -1;
 
-module_param(maxSession, int, S_IRUSR | S_IRGRP | S_IROTH);
-MODULE_PARM_DESC(myint, "Max sessions");
-module_param(bufferOrder, int, S_IRUSR | S_IRGRP | S_IROTH);
-MODULE_PARM_DESC(myint, "Order of the maximum size of the session buffer");
+// Set once the session module is running, from then on the writable parameters are applied on the fly
+static int moduleReady = 0;
+
+/*
+ * Parses and stores a writable parameter. While loading the value is only stored, init applies it, later
+ * it's applied through apply and the value actually applied, as capped by apply, is stored
+ */
+static int _setParam(const char *val, const struct kernel_param *kp,
+		int (*apply)(int)) {
+	int value;
+	int ret;
+
+	ret = kstrtoint(val, 0, &value);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (moduleReady) {
+		ret = apply(value);
+		if (ret < 0) {
+			return ret;
+		}
+		value = ret;
+	}
+
+	*(int*) kp->arg = value;
+	return 0;
+}
+
+static int _setMaxSession(const char *val, const struct kernel_param *kp) {
+	return _setParam(val, kp, sessionSetMaxSession);
+}
+
+static int _setBufferOrder(const char *val, const struct kernel_param *kp) {
+	return _setParam(val, kp, sessionSetBufferOrder);
+}
+
+static int _setPoolSize(const char *val, const struct kernel_param *kp) {
+	return _setParam(val, kp, sessionSetPoolSize);
+}
+
+static struct kernel_param_ops maxSessionOps = {
+	set : _setMaxSession,
+	get : param_get_int,
+};
+
+static struct kernel_param_ops bufferOrderOps = {
+	set : _setBufferOrder,
+	get : param_get_int,
+};
+
+static struct kernel_param_ops poolSizeOps = {
+	set : _setPoolSize,
+	get : param_get_int,
+};
+
+module_param_cb(maxSession, &maxSessionOps, &maxSession, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(maxSession, "Max sessions, lowering it applies to new sessions only");
+module_param_cb(bufferOrder, &bufferOrderOps, &bufferOrder, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(bufferOrder, "Order of the maximum size of the session buffer, applies to new sessions only");
+module_param(bufferPolicy, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(bufferPolicy, "Session buffer placement: 0 node of the opener, 1 node of the first access");
+module_param_cb(poolSize, &poolSizeOps, &poolSize, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(poolSize, "Number of free session buffers kept per NUMA node");
 
 static int __init init_sessionSyscall(void) {
 	int ret = -1;
 	printk(KERN_INFO "Installing Session Module\n");
 
-	ret = registerSessionSyscall(maxSession, bufferOrder);
+	ret = registerSessionSyscall(maxSession, bufferOrder, bufferPolicy, poolSize);
 	if (ret < 0) {
 		return ret;
 	}
+	moduleReady = 1;
 
 	return 0;
 }
 
 static void __exit cleanup_sessionSyscall(void) {
 	printk(KERN_INFO "Removing Session Module\n");
+	moduleReady = 0;
 	unregisterSessionSyscall();
 }
 
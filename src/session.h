@@ -12,6 +12,17 @@
 #ifndef SESSION_H_
 #define SESSION_H_
 
+#include <unistd.h>
+#include <sys/syscall.h>
+
 #include "Defines.h"
 
+/*
+ * Opens all the files described by the requests array as sessions in one call. Either all the sessions are
+ * created, and each fd field is filled in, or none is and -1 is returned with errno set
+ */
+static inline int sessionOpenBatch(struct sessionOpenRequest *requests, int count) {
+	return syscall(__NR_sessionOpenBatch, requests, count);
+}
+
 #endif /* SESSION_H_ */
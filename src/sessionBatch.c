@@ -0,0 +1,128 @@
+/*
+ ============================================================================
+ Name        : sessionBatch.c
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Implementation of the batched session open, which opens a whole
+ 	 set of files as sessions with a single admission and overlapped copy-ins
+ ============================================================================
+ */
+
+#include <linux/kernel.h>
+#include <linux/linkage.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <asm/uaccess.h>
+
+#include "Defines.h"
+#include "sessionCompat.h"
+#include "sessionFileOperations.h"
+#include "sessionBatch.h"
+
+/*
+ * Opens count files as sessions. The session slots of the whole batch are reserved at once, then all the
+ * files are opened and their reads started, and only then the session buffers are filled, so that the
+ * copy-ins of the batch overlap. If anything fails, every file opened so far is closed and no session survives.
+ * @requests: user array of requests, the fd field of each entry is filled in on success
+ * @count: number of entries in requests
+ * @originalOpen: function calling the original open syscall
+ */
+long sessionOpenBatch(struct sessionOpenRequest __user *requests, int count,
+		sessionOriginalOpen originalOpen) {
+	struct sessionOpenRequest *kRequests;
+	struct file **filePtrs;
+	int opened = 0;
+	int created = 0;
+	int i;
+	long fd;
+	long ret;
+
+	if (count <= 0 || count > SESSION_BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	kRequests = kmalloc(count * sizeof(struct sessionOpenRequest), GFP_KERNEL);
+	filePtrs = kmalloc(count * sizeof(struct file *), GFP_KERNEL);
+	if (kRequests == NULL || filePtrs == NULL ) {
+		printk(KERN_WARNING "Can't allocate batch requests\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(kRequests, requests,
+			count * sizeof(struct sessionOpenRequest))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	// Admission is all or nothing: the slots of the whole batch are reserved before opening anything
+	ret = sessionReserve(count);
+	if (ret < 0) {
+		goto out;
+	}
+
+	// First pass: open every file and start reading its contents in the page cache
+	for (opened = 0; opened < count; opened++) {
+		fd = originalOpen(kRequests[opened].pathname,
+				sessionRealOpenFlags(kRequests[opened].flags | O_SESSION),
+				kRequests[opened].mode);
+		if (fd < 0) {
+			ret = fd;
+			goto rollback;
+		}
+		kRequests[opened].fd = fd;
+
+		filePtrs[opened] = fget(fd);
+		if (filePtrs[opened] == NULL ) {
+			// Someone else closed the fd meanwhile
+			opened++;
+			ret = -EBADF;
+			goto rollback;
+		}
+		sessionPrefetch(filePtrs[opened]);
+	}
+
+	// Second pass: create the sessions, the reads started above are completing meanwhile
+	for (created = 0; created < count; created++) {
+		ret = sessionOpenReserved(filePtrs[created],
+				kRequests[created].flags | O_SESSION, kRequests[created].mode);
+		if (ret < 0) {
+			goto rollback;
+		}
+	}
+
+	if (copy_to_user(requests, kRequests,
+			count * sizeof(struct sessionOpenRequest))) {
+		ret = -EFAULT;
+		goto rollback;
+	}
+
+	for (i = 0; i < count; i++) {
+		fput(filePtrs[i]);
+	}
+	ret = 0;
+	goto out;
+
+rollback:
+	// Slots not taken by a session are given back here, the created sessions release their own on close
+	sessionUnreserve(count - created);
+	for (i = 0; i < opened; i++) {
+		// The created sessions are aborted, else their close would write them back and truncate the O_TRUNC ones
+		if (i < created) {
+			sessionAbort(filePtrs[i]);
+		}
+		if (filePtrs[i] != NULL ) {
+			fput(filePtrs[i]);
+		}
+		_closeFd(kRequests[i].fd);
+	}
+
+out:
+	kfree(filePtrs);
+	kfree(kRequests);
+	return ret;
+}
@@ -0,0 +1,23 @@
+/*
+ ============================================================================
+ Name        : sessionBatch.h
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Declaration of the batched session open
+ ============================================================================
+ */
+
+#ifndef SESSIONBATCH_H_
+#define SESSIONBATCH_H_
+
+#include "Defines.h"
+
+// Prototype of the function used to reach the original open syscall
+typedef long (*sessionOriginalOpen)(const char __user *pathname, int flags, int mode);
+
+long sessionOpenBatch(struct sessionOpenRequest __user *requests, int count,
+		sessionOriginalOpen originalOpen);
+
+#endif /* SESSIONBATCH_H_ */
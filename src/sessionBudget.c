@@ -0,0 +1,373 @@
+/*
+ ============================================================================
+ Name        : sessionBudget.c
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Budgets of sessions and of session buffer bytes, charged to
+ 	 the user opening the session and, on kernels with the default cgroup
+ 	 hierarchy, to its cgroup. Accounts are found under RCU and charged
+ 	 with atomic operations, the lock of their bucket is taken only when an
+ 	 account comes and goes. Openers waiting for a session of an account
+ 	 are admitted in FIFO order
+ ============================================================================
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/hash.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/cred.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#ifdef CONFIG_CGROUPS
+#include <linux/cgroup.h>
+#endif
+
+#include "sessionCompat.h"
+#include "sessionBudget.h"
+
+#define BUDGET_BITS 6 // Log2 of the number of buckets of the accounts
+
+struct sessionBudget_struct {
+	int type; // SESSION_BUDGET_USER or SESSION_BUDGET_CGROUP
+	u64 key; // Identifier of the user or of the cgroup
+	atomic_t refs; // Sessions charged plus openers waiting, the account goes away when none is left
+	atomic_long_t sessions; // Sessions charged
+	atomic_long_t bytes; // Session buffer bytes charged
+	wait_queue_head_t admissionQueue; // Openers waiting for a session of the account, in FIFO order
+	struct sessionBudget_struct *next; // Next account of the bucket
+	struct rcu_head rcu;
+};
+
+// Limits of every user and of every cgroup, 0 does not limit
+static int userMaxSessions = 0;
+module_param(userMaxSessions, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(userMaxSessions, "Maximum number of sessions of each user, 0 for no limit");
+static unsigned long userMaxBytes = 0;
+module_param(userMaxBytes, ulong, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(userMaxBytes, "Maximum session buffer bytes of each user, 0 for no limit");
+static int cgroupMaxSessions = 0;
+module_param(cgroupMaxSessions, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(cgroupMaxSessions, "Maximum number of sessions of each cgroup, 0 for no limit");
+static unsigned long cgroupMaxBytes = 0;
+module_param(cgroupMaxBytes, ulong, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(cgroupMaxBytes, "Maximum session buffer bytes of each cgroup, 0 for no limit");
+
+// Accounts hashed by type and key. Walked under RCU, the lock of a bucket is taken to add and remove accounts
+static sessionBudget *budgetBuckets[1 << BUDGET_BITS];
+static spinlock_t budgetLocks[1 << BUDGET_BITS];
+
+/*
+ * Initializes the buckets of the accounts
+ */
+void sessionBudgetInit(void) {
+	int i;
+
+	for (i = 0; i < (1 << BUDGET_BITS); i++) {
+		spin_lock_init(&budgetLocks[i]);
+	}
+}
+
+/*
+ * Returns the session limit of an account type
+ */
+static inline long _budgetMaxSessions(int type) {
+	return type == SESSION_BUDGET_USER ?
+			ACCESS_ONCE(userMaxSessions) : ACCESS_ONCE(cgroupMaxSessions);
+}
+
+/*
+ * Returns the byte limit of an account type
+ */
+static inline unsigned long _budgetMaxBytes(int type) {
+	return type == SESSION_BUDGET_USER ?
+			ACCESS_ONCE(userMaxBytes) : ACCESS_ONCE(cgroupMaxBytes);
+}
+
+/*
+ * Retrieves the key of the account of the given type of the calling task
+ * Returns true if the task has such an account
+ */
+static int _budgetKey(int type, u64 *key) {
+	if (type == SESSION_BUDGET_USER) {
+		*key = _currentUid();
+		return 1;
+	}
+#if defined(SESSION_HAVE_ITER) && defined(CONFIG_CGROUPS)
+	rcu_read_lock();
+	*key = cgroup_id(task_dfl_cgroup(current));
+	rcu_read_unlock();
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Returns the bucket of an account
+ */
+static inline unsigned int _budgetHash(int type, u64 key) {
+	return hash_64(key ^ ((u64) type << 63), BUDGET_BITS);
+}
+
+/*
+ * Looks for an account in its bucket, called under RCU
+ */
+static sessionBudget* _budgetFind(int type, u64 key, unsigned int hash) {
+	sessionBudget *budget;
+
+	for (budget = rcu_dereference(budgetBuckets[hash]); budget != NULL;
+			budget = rcu_dereference(budget->next)) {
+		if (budget->type == type && budget->key == key) {
+			return budget;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns the account, creating it if needed, with a reference taken
+ * Returns NULL if the account can't be allocated
+ */
+static sessionBudget* _budgetGet(int type, u64 key) {
+	unsigned int hash = _budgetHash(type, key);
+	sessionBudget *budget;
+	sessionBudget *newBudget;
+
+	rcu_read_lock();
+	budget = _budgetFind(type, key, hash);
+	if (budget != NULL && atomic_inc_not_zero(&budget->refs)) {
+		rcu_read_unlock();
+		return budget;
+	}
+	rcu_read_unlock();
+
+	// Allocated out of the bucket lock, and dropped if the account has been added meanwhile
+	newBudget = (sessionBudget*) kzalloc(sizeof(sessionBudget), GFP_KERNEL);
+	if (newBudget == NULL ) {
+		return NULL;
+	}
+	newBudget->type = type;
+	newBudget->key = key;
+	atomic_set(&newBudget->refs, 1);
+	init_waitqueue_head(&newBudget->admissionQueue);
+
+	// The accounts lose their last reference under the bucket lock only, and leave the bucket right away
+	spin_lock(&budgetLocks[hash]);
+	rcu_read_lock();
+	budget = _budgetFind(type, key, hash);
+	rcu_read_unlock();
+	if (budget != NULL) {
+		atomic_inc(&budget->refs);
+	} else {
+		newBudget->next = budgetBuckets[hash];
+		rcu_assign_pointer(budgetBuckets[hash], newBudget);
+		budget = newBudget;
+		newBudget = NULL;
+	}
+	spin_unlock(&budgetLocks[hash]);
+
+	kfree(newBudget);
+	return budget;
+}
+
+/*
+ * Drops a reference to the account, freeing it once no reference is left
+ */
+static void _budgetPut(sessionBudget *budget) {
+	unsigned int hash = _budgetHash(budget->type, budget->key);
+	sessionBudget **link;
+
+	if (!atomic_dec_and_lock(&budget->refs, &budgetLocks[hash])) {
+		return;
+	}
+
+	for (link = &budgetBuckets[hash]; *link != budget; link = &(*link)->next)
+		;
+	rcu_assign_pointer(*link, budget->next);
+	spin_unlock(&budgetLocks[hash]);
+
+	// Walkers of the bucket may still be looking at it
+	kfree_rcu(budget, rcu);
+}
+
+/*
+ * Adds amount to the counter only if the result does not exceed limit, a limit of 0 does not limit. The limit
+ * is unsigned as the byte limits are, a negative session limit does not limit either
+ * Returns 0 on success, -EDQUOT if the counter has not been changed
+ */
+static int _budgetAdd(atomic_long_t *counter, long amount, unsigned long limit) {
+	long currentValue;
+	long previousValue;
+
+	currentValue = atomic_long_read(counter);
+	for (;;) {
+		if (limit != 0 && (unsigned long) (currentValue + amount) > limit) {
+			return -EDQUOT;
+		}
+		previousValue = atomic_long_cmpxchg(counter, currentValue,
+				currentValue + amount);
+		if (likely(previousValue == currentValue)) {
+			return 0;
+		}
+		currentValue = previousValue;
+	}
+}
+
+/*
+ * Charges a session to the account. If the account has none left and waiting has been requested, sleeps
+ * until a session of the account goes away. Sleepers are woken one per session, oldest first
+ * Returns 0 on success, -EDQUOT if no session became available, -EINTR if interrupted by a signal
+ * @budget: the account, whose reference the caller holds meanwhile
+ * @type: type of the account
+ * @wait: true to wait for a session
+ * @timeout: maximum wait in jiffies, updated with the time left
+ */
+static int _budgetAdmitOne(sessionBudget *budget, int type, int wait,
+		long *timeout) {
+	DECLARE_WAITQUEUE(waiter, current);
+	int ret = 0;
+
+	// Newcomers must not overtake the openers already waiting
+	if (!waitqueue_active(&budget->admissionQueue)
+			&& _budgetAdd(&budget->sessions, 1, _budgetMaxSessions(type)) == 0) {
+		return 0;
+	}
+
+	if (!wait) {
+		return -EDQUOT;
+	}
+
+	add_wait_queue_exclusive(&budget->admissionQueue, &waiter);
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (_budgetAdd(&budget->sessions, 1, _budgetMaxSessions(type)) == 0) {
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		if (*timeout == 0) {
+			ret = -EDQUOT;
+			break;
+		}
+		*timeout = schedule_timeout(*timeout);
+	}
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&budget->admissionQueue, &waiter);
+
+	// Leaving without a session may have consumed the wake up meant for the next waiter
+	if (ret < 0) {
+		wake_up(&budget->admissionQueue);
+	}
+
+	return ret;
+}
+
+/*
+ * Charges a session to every account of the calling task, all of them or none. The accounts are returned in
+ * budgets, which holds a reference to each of them until sessionBudgetRelease
+ * Returns 0 on success, -EDQUOT if an account has no session left, -EINTR if interrupted while waiting,
+ * -ENOMEM if an account can't be allocated
+ * @budgets: returns the accounts, SESSION_BUDGETS entries, NULL for the types the task has no account of
+ * @wait: true to wait for the accounts having no session left
+ * @timeout: maximum wait in jiffies, MAX_SCHEDULE_TIMEOUT to wait forever
+ */
+int sessionBudgetAdmit(sessionBudget **budgets, int wait, long timeout) {
+	u64 key;
+	int type;
+	int ret;
+
+	for (type = 0; type < SESSION_BUDGETS; type++) {
+		budgets[type] = NULL;
+	}
+
+	for (type = 0; type < SESSION_BUDGETS; type++) {
+		if (!_budgetKey(type, &key)) {
+			continue;
+		}
+
+		budgets[type] = _budgetGet(type, key);
+		if (budgets[type] == NULL) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+
+		ret = _budgetAdmitOne(budgets[type], type, wait, &timeout);
+		if (ret < 0) {
+			_budgetPut(budgets[type]);
+			budgets[type] = NULL;
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	if (ret == -EDQUOT) {
+		printk(KERN_WARNING "Session budget exceeded\n");
+	}
+	sessionBudgetRelease(budgets);
+	return ret;
+}
+
+/*
+ * Gives back the session charged by sessionBudgetAdmit, waking the oldest opener waiting for each account.
+ * The bytes must have been uncharged already
+ */
+void sessionBudgetRelease(sessionBudget **budgets) {
+	int type;
+
+	for (type = 0; type < SESSION_BUDGETS; type++) {
+		if (budgets[type] == NULL) {
+			continue;
+		}
+		atomic_long_dec(&budgets[type]->sessions);
+		wake_up(&budgets[type]->admissionQueue);
+		_budgetPut(budgets[type]);
+		budgets[type] = NULL;
+	}
+}
+
+/*
+ * Charges session buffer bytes to the accounts, all of them or none. Never waits
+ * Returns 0 on success, -EDQUOT if an account would exceed its limit
+ */
+int sessionBudgetCharge(sessionBudget **budgets, long bytes) {
+	int type;
+	int undo;
+
+	for (type = 0; type < SESSION_BUDGETS; type++) {
+		if (budgets[type] == NULL) {
+			continue;
+		}
+		if (_budgetAdd(&budgets[type]->bytes, bytes, _budgetMaxBytes(type)) < 0) {
+			for (undo = 0; undo < type; undo++) {
+				if (budgets[undo] != NULL) {
+					atomic_long_sub(bytes, &budgets[undo]->bytes);
+				}
+			}
+			return -EDQUOT;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Gives back session buffer bytes charged with sessionBudgetCharge
+ */
+void sessionBudgetUncharge(sessionBudget **budgets, long bytes) {
+	int type;
+
+	for (type = 0; type < SESSION_BUDGETS; type++) {
+		if (budgets[type] != NULL) {
+			atomic_long_sub(bytes, &budgets[type]->bytes);
+		}
+	}
+}
@@ -0,0 +1,28 @@
+/*
+ ============================================================================
+ Name        : sessionBudget.h
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Declaration of the per user and per cgroup session budgets
+ ============================================================================
+ */
+
+#ifndef SESSIONBUDGET_H_
+#define SESSIONBUDGET_H_
+
+#define SESSION_BUDGET_USER 0 // Account of the user opening the session
+#define SESSION_BUDGET_CGROUP 1 // Account of the cgroup of the opener, on kernels with the default hierarchy
+#define SESSION_BUDGETS 2 // Accounts charged by a session
+
+// Sessions and session buffer bytes charged to a user or to a cgroup
+typedef struct sessionBudget_struct sessionBudget;
+
+void sessionBudgetInit(void);
+int sessionBudgetAdmit(sessionBudget **budgets, int wait, long timeout);
+void sessionBudgetRelease(sessionBudget **budgets);
+int sessionBudgetCharge(sessionBudget **budgets, long bytes);
+void sessionBudgetUncharge(sessionBudget **budgets, long bytes);
+
+#endif /* SESSIONBUDGET_H_ */
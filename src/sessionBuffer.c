@@ -0,0 +1,292 @@
+/*
+ ============================================================================
+ Name        : sessionBuffer.c
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Implementation of the session buffer allocator. Buffers are
+ 	 allocated on a requested NUMA node, and freed buffers are kept in a
+ 	 small per node pool to be reused by the next sessions opened there.
+ 	 On current kernels the buffers can be charged to the memory cgroup of
+ 	 the opener instead, and are not pooled then
+ ============================================================================
+ */
+
+#include <linux/kernel.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include "sessionCompat.h"
+#include "sessionBuffer.h"
+
+#define MAX_POOLSIZE 512 // Maximum number of free buffers kept per node
+
+struct sessionBufferPool_struct {
+	spinlock_t lock; // Lock protecting the free list
+	char *freeList; // Free buffers, linked through their first word
+	int count; // Number of buffers in the free list
+	int order; // Order of the buffers in the free list
+};
+
+typedef struct sessionBufferPool_struct sessionBufferPool;
+
+static sessionBufferPool *pools = NULL; // One pool per node
+static int poolOrder = 0; // Order of the buffers kept in the pools
+static int poolMaxCount = 0; // Maximum number of buffers kept per node
+static DEFINE_MUTEX(poolResizeLock); // Serializes the changes of the pool order and size
+
+#ifdef SESSION_HAVE_ITER
+// If set, the session buffers are charged to the memory cgroup of the opener. The charge is taken when the
+// pages are allocated and dropped when they are freed, hence a pooled buffer would stay charged to the
+// cgroup that allocated it first: charged buffers bypass the pools
+static int chargeMemcg = 1;
+module_param(chargeMemcg, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(chargeMemcg, "Charge the session buffers to the memory cgroup of the opener, without pooling them");
+#else
+// Kernels without accounting of kernel memory in the memory cgroups
+#define chargeMemcg 0
+#endif
+
+/*
+ * Allocates a buffer of the given order on the given node, bypassing the pools
+ */
+static char* _allocOnNode(int node, int order, gfp_t flags) {
+	struct page *page;
+
+	page = alloc_pages_node(node, flags, order);
+	if (page == NULL ) {
+		return NULL ;
+	}
+	return (char*) page_address(page);
+}
+
+/*
+ * Clamps a requested pool size to the allowed range
+ */
+static int _clampPoolSize(int poolSize) {
+	if (poolSize < 0) {
+		return 0;
+	}
+	if (poolSize > MAX_POOLSIZE) {
+		return MAX_POOLSIZE;
+	}
+	return poolSize;
+}
+
+/*
+ * Frees the buffers of a detached free list
+ */
+static void _freeList(char *list, int order) {
+	char *buffer;
+
+	while ((buffer = list) != NULL ) {
+		list = *(char**) buffer;
+		free_pages((unsigned long) buffer, order);
+	}
+}
+
+/*
+ * Fills the pools of the online nodes up to poolMaxCount, only with memory really local to each node
+ */
+static void _fillPools(void) {
+	int node;
+	char *buffer;
+
+	if (chargeMemcg) {
+		return;
+	}
+
+	for_each_online_node(node) {
+		while (pools[node].count < poolMaxCount) {
+			buffer = _allocOnNode(node, poolOrder, GFP_KERNEL | __GFP_THISNODE | __GFP_NOWARN);
+			if (buffer == NULL ) {
+				break;
+			}
+			spin_lock(&pools[node].lock);
+			if (pools[node].order != poolOrder || pools[node].count >= poolMaxCount) {
+				spin_unlock(&pools[node].lock);
+				free_pages((unsigned long) buffer, poolOrder);
+				break;
+			}
+			*(char**) buffer = pools[node].freeList;
+			pools[node].freeList = buffer;
+			pools[node].count++;
+			spin_unlock(&pools[node].lock);
+		}
+	}
+}
+
+/*
+ * Initializes one pool per possible node and fills the pools of the online nodes
+ * @order: order of the pooled buffers
+ * @poolSize: number of buffers kept per node
+ */
+int sessionBufferInit(int order, int poolSize) {
+	int node;
+
+	poolOrder = order;
+	poolMaxCount = _clampPoolSize(poolSize);
+
+	pools = (sessionBufferPool*) kzalloc(nr_node_ids * sizeof(sessionBufferPool),
+	GFP_KERNEL);
+	if (pools == NULL ) {
+		printk(KERN_WARNING "Can't allocate session buffer pools\n");
+		return -ENOMEM;
+	}
+
+	for (node = 0; node < nr_node_ids; node++) {
+		spin_lock_init(&pools[node].lock);
+		pools[node].order = poolOrder;
+	}
+
+	_fillPools();
+
+	return 0;
+}
+
+/*
+ * Changes the order and the size of the pools while sessions exist. The buffers of the old order are given
+ * back to the system, the buffers in use are freed with their own order, then the pools are filled again
+ * @order: order of the pooled buffers
+ * @poolSize: number of buffers kept per node, if less than 0 the current size is kept
+ */
+void sessionBufferResize(int order, int poolSize) {
+	int node;
+	char *detached;
+	int detachedOrder;
+	char *buffer;
+
+	mutex_lock(&poolResizeLock);
+
+	poolOrder = order;
+	if (poolSize >= 0) {
+		poolMaxCount = _clampPoolSize(poolSize);
+	}
+
+	for (node = 0; node < nr_node_ids; node++) {
+		detached = NULL;
+
+		spin_lock(&pools[node].lock);
+		detachedOrder = pools[node].order;
+		if (pools[node].order != poolOrder) {
+			// None of the pooled buffers fits the new order
+			detached = pools[node].freeList;
+			pools[node].freeList = NULL;
+			pools[node].count = 0;
+			pools[node].order = poolOrder;
+		} else {
+			// Only the buffers exceeding the new size are dropped
+			while (pools[node].count > poolMaxCount) {
+				buffer = pools[node].freeList;
+				pools[node].freeList = *(char**) buffer;
+				pools[node].count--;
+				*(char**) buffer = detached;
+				detached = buffer;
+			}
+		}
+		spin_unlock(&pools[node].lock);
+
+		_freeList(detached, detachedOrder);
+	}
+
+	_fillPools();
+
+	mutex_unlock(&poolResizeLock);
+}
+
+/*
+ * Gives back to the system all the pooled buffers
+ */
+void sessionBufferCleanup(void) {
+	int node;
+
+	if (pools == NULL ) {
+		return;
+	}
+
+	for (node = 0; node < nr_node_ids; node++) {
+		_freeList(pools[node].freeList, pools[node].order);
+		pools[node].freeList = NULL;
+		pools[node].count = 0;
+	}
+
+	kfree(pools);
+	pools = NULL;
+}
+
+/*
+ * Returns a buffer of the given order, taken from the pool of the node if possible, otherwise allocated on it.
+ * The content of the returned buffer is undefined
+ * @node: preferred node, or NUMA_NO_NODE for the node of the calling CPU
+ * @order: order of the buffer
+ */
+char* sessionBufferAlloc(int node, int order) {
+	char *buffer = NULL;
+
+	if (node == NUMA_NO_NODE ) {
+		node = numa_node_id();
+	}
+
+#ifdef SESSION_HAVE_ITER
+	if (chargeMemcg) {
+		return _allocOnNode(node, order, GFP_KERNEL_ACCOUNT);
+	}
+#endif
+
+	if (order == pools[node].order && pools[node].count > 0) {
+		spin_lock(&pools[node].lock);
+		// The pool may have been resized meanwhile
+		if (pools[node].freeList != NULL && order == pools[node].order) {
+			buffer = pools[node].freeList;
+			pools[node].freeList = *(char**) buffer;
+			pools[node].count--;
+		}
+		spin_unlock(&pools[node].lock);
+	}
+
+	if (buffer == NULL ) {
+		buffer = _allocOnNode(node, order, GFP_KERNEL);
+	}
+
+	return buffer;
+}
+
+/*
+ * Gives back a buffer, keeping it in the pool of its node if there is room left
+ * @buffer: the buffer
+ * @order: order of the buffer, as passed to sessionBufferAlloc
+ */
+void sessionBufferFree(char *buffer, int order) {
+	int node;
+
+	if (order == poolOrder && !chargeMemcg) {
+		node = sessionBufferNode(buffer);
+		spin_lock(&pools[node].lock);
+		if (order == pools[node].order && pools[node].count < poolMaxCount) {
+			*(char**) buffer = pools[node].freeList;
+			pools[node].freeList = buffer;
+			pools[node].count++;
+			buffer = NULL;
+		}
+		spin_unlock(&pools[node].lock);
+	}
+
+	if (buffer != NULL ) {
+		free_pages((unsigned long) buffer, order);
+	}
+}
+
+/*
+ * Returns the node on which the buffer lies
+ */
+int sessionBufferNode(char *buffer) {
+	return page_to_nid(virt_to_page(buffer));
+}
@@ -0,0 +1,28 @@
+/*
+ ============================================================================
+ Name        : sessionBuffer.h
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Declaration of the per node session buffer allocator
+ ============================================================================
+ */
+
+#ifndef SESSIONBUFFER_H_
+#define SESSIONBUFFER_H_
+
+#include <linux/numa.h>
+
+#ifndef NUMA_NO_NODE
+#define NUMA_NO_NODE (-1)
+#endif
+
+int sessionBufferInit(int order, int poolSize);
+void sessionBufferCleanup(void);
+void sessionBufferResize(int order, int poolSize);
+char* sessionBufferAlloc(int node, int order);
+void sessionBufferFree(char *buffer, int order);
+int sessionBufferNode(char *buffer);
+
+#endif /* SESSIONBUFFER_H_ */
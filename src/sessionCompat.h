@@ -0,0 +1,104 @@
+/*
+ ============================================================================
+ Name        : sessionCompat.h
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Macros hiding the differences between the 3.2 kernel targeted
+ 	 	 	 by the module and the current LTS kernels
+ ============================================================================
+ */
+
+#ifndef SESSIONCOMPAT_H_
+#define SESSIONCOMPAT_H_
+
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/sched.h>
+#include <linux/linkage.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/clock.h>
+#endif
+
+// Current kernels: session fops built on read_iter/write_iter, open hooked through ftrace. The opens for
+// writing and the size changes are hooked as well, whoever does them, so the copy-in can be deferred
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#define SESSION_HAVE_ITER
+#define SESSION_HOOK_WRITERS
+#endif
+
+// Closes a descriptor of the current process
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#include <linux/fdtable.h>
+#define _closeFd(fd) close_fd(fd)
+#elif defined(SESSION_HAVE_ITER)
+#include <linux/fdtable.h>
+#define _closeFd(fd) __close_fd(current->files, fd)
+#else
+extern asmlinkage long sys_close(unsigned int fd);
+#define _closeFd(fd) sys_close(fd)
+#endif
+
+#ifdef SESSION_HAVE_ITER
+#define _fileInode(filePtr) file_inode(filePtr)
+#define _fileDentry(filePtr) ((filePtr)->f_path.dentry)
+#else
+#define _fileInode(filePtr) ((filePtr)->f_dentry->d_inode)
+#define _fileDentry(filePtr) ((filePtr)->f_dentry)
+#endif
+
+// True if the address space can read a single page in the page cache
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#define _mappingCanReadPages(mapping) ((mapping) != NULL \
+		&& (mapping)->a_ops != NULL && (mapping)->a_ops->read_folio != NULL)
+#else
+#define _mappingCanReadPages(mapping) ((mapping) != NULL \
+		&& (mapping)->a_ops != NULL && (mapping)->a_ops->readpage != NULL)
+#endif
+
+// Inode times and version, as recorded by the sessions checking their base on commit
+#ifdef SESSION_HAVE_ITER
+#include <linux/iversion.h>
+typedef struct timespec64 sessionStamp;
+#define _stampCompare(a, b) timespec64_compare(a, b)
+#define _currentTime(inode) current_time(inode)
+#define _inodeVersion(inode) inode_query_iversion(inode)
+#else
+typedef struct timespec sessionStamp;
+#define _stampCompare(a, b) timespec_compare(a, b)
+#define _currentTime(inode) current_fs_time((inode)->i_sb)
+#define _inodeVersion(inode) ((inode)->i_version)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#define _inodeMtime(inode) inode_get_mtime(inode)
+#define _inodeCtime(inode) inode_get_ctime(inode)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define _inodeMtime(inode) ((inode)->i_mtime)
+#define _inodeCtime(inode) inode_get_ctime(inode)
+#else
+#define _inodeMtime(inode) ((inode)->i_mtime)
+#define _inodeCtime(inode) ((inode)->i_ctime)
+#endif
+
+// User opening a session, as charged by the session budgets
+#ifdef SESSION_HAVE_ITER
+#define _currentUid() from_kuid(&init_user_ns, current_uid())
+#else
+#define _currentUid() current_uid()
+#endif
+
+#ifndef PAGE_CACHE_SIZE
+#define PAGE_CACHE_SIZE PAGE_SIZE
+#define PAGE_CACHE_SHIFT PAGE_SHIFT
+#define page_cache_release(page) put_page(page)
+#endif
+
+#ifndef ACCESS_ONCE
+#define ACCESS_ONCE(x) READ_ONCE(x)
+#endif
+
+#endif /* SESSIONCOMPAT_H_ */
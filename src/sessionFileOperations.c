@@ -21,10 +21,29 @@
 #include <linux/mutex.h>
 #include <linux/delay.h>
 #include <linux/sched.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/falloc.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
+#include <linux/moduleparam.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
+#include <linux/list.h>
+#include <linux/blkdev.h>
+#include <linux/writeback.h>
+#include <linux/hash.h>
 
 #include "Defines.h"
 #include "sessionFileOperations.h"
+#include "sessionBuffer.h"
+#include "sessionCompat.h"
 #include "workaround.h"
+#include "sessionTrace.h"
+#include "sessionJournal.h"
+#include "sessionBudget.h"
 
 #define DEFAULT_SESSIONNUM 512 // Default maximum session num
 #define MAX_SESSIONNUM 2048 // session num cap
@@ -32,35 +51,205 @@
 #define DEFAULT_ORDER 2 // Default order of pages allocated per session buffer
 #define MAX_PAGENUM 16 // Maximum number of pages allocated per session buffer
 #define MAX_BUFFERORDER 4 // Maximum order of pages allocated per session buffer
+#define DEFAULT_POOLSIZE 16 // Default number of free session buffers kept per NUMA node
+#define MAX_RETIREDBUFFERS (MAX_BUFFERORDER + 2) // Buffers replaced while in use: one per growth, plus the migration
+#define COMMITLOCK_BITS 6 // Log2 of the number of locks serializing the write backs of the same file
+#define DEFERRED_BITS 6 // Log2 of the number of lists of the sessions deferring their copy-in
 
 #define KAMLLOCFLAGS GFP_KERNEL | __GFP_ZERO // kmalloc flags
 
 #define BADSTATEFLAG 0x10000000
 
 static int maxSessionNum = DEFAULT_SESSIONNUM; // Current maximum session num
-static int maxBufferSize = 4096 * DEFAULT_PAGENUM; // Current session buffer size
-static int maxBufferOrder = DEFAULT_ORDER; // Current session buffer order
+static int maxBufferOrder = DEFAULT_ORDER; // Current session buffer order, applied to the new sessions
+static int bufferNodePolicy = SESSION_NODE_OPENER; // Current session buffer placement policy
 
 struct sessionData_struct {
 	atomic_t usageCountAndFlag; // Usage Counter and Flag to mark a bad state struct
 	char* buffer; // Pointer to the sesssion buffer
+	int bufferOrder; // Order of the session buffer
+	int maxOrder; // Order up to which the session buffer can grow
+	int readOnly; // Set if the session has been opened with the read only hint
+	int aborted; // Set if the session has been aborted, nothing is written back on close
+	int noCache; // Set if the commits must not leave the written contents in the page cache
+	int checked; // Set if the write backs must fail when the file changed since the session copied it in
+	loff_t baseSize; // Size of the file when the session copied it in
+	u64 baseVersion; // Inode version when the session copied it in
+	sessionStamp baseMtime; // Modification time of the file when the session copied it in
+	sessionStamp baseCtime; // Change time of the file when the session copied it in
+	sessionStamp baseTaken; // Time the base has been recorded, at the granularity of the filesystem
+	int baseByContent; // Set if the metadata can't tell a change, the base is compared on the contents
+	u32 baseChecksum; // Checksum of the file contents copied in, taken from the block hashes
+	int baseChecksumValid; // Set if the whole file has been copied in, hence baseChecksum holds
+	int deferred; // Set while the copy-in is deferred and the reads are served from the page cache
+	int deferredError; // Error of a deferred copy-in that failed, returned by the reads from then on
+	struct list_head deferredList; // Link in the sessions deferring their copy-in, empty once unregistered
+	struct file *filePtr; // Session file, NULL once released
+	sessionGroup *group; // Group of the session, NULL if none
+	struct list_head groupList; // Link in the members of the group
+	struct file *commitFilePtr; // File a member of a group is written back through
+	int migrateOnAccess; // Set if the buffer must be moved to the node of the first access
+	char* retiredBuffers[MAX_RETIREDBUFFERS]; // Buffers replaced while still in use, freed on teardown
+	int retiredOrders[MAX_RETIREDBUFFERS]; // Order of each retired buffer
+	int retiredCount; // Number of retired buffers
 	struct rw_semaphore fileInBufferLock; // Lock that protects the size of the stored file
 	unsigned long fileInBufferSize; // Size of the stored size
+	u32 blockHash[MAX_PAGENUM]; // Hash of each page sized block of the buffer, taken when copied in
+	unsigned long hashedBlocks; // Bitmask of the blocks hashed while holding the file contents
+	unsigned long loadedBlocks; // Bitmask of the blocks whose file contents are in the buffer
+	unsigned long droppedBlocks; // Bitmask of the blocks the session wrote and then dropped from the page cache
+	unsigned long loadableSize; // Size of the file contents that can still be copied in on demand
 	struct mutex writeLock; // Lock against concurrent writes
 	void* private_data; // Pointer to the previous private_data
 	const struct file_operations * oldFops; // Pointer to the previous fops
+	u64 traceId; // Identifier of the session in the trace capture, 0 if opened while it was stopped
+	sessionBudget *budgets[SESSION_BUDGETS]; // Accounts the session is charged to
+	unsigned long chargedBytes; // Session buffer bytes charged to the accounts
 };
 
 typedef struct sessionData_struct sessionData;
 
+/*
+ * Records a session operation if the trace capture is running and the session is traced
+ */
+static inline void _trace(int type, sessionData *sessionDataPtr, loff_t offset,
+		unsigned int size, unsigned int mode) {
+	if (unlikely(sessionTraceEnabled) && sessionDataPtr->traceId != 0) {
+		sessionTraceRecord(type, sessionDataPtr->traceId, offset, size, mode);
+	}
+}
+
+// Sessions written back together
+struct sessionGroup_struct {
+	struct mutex lock; // Lock against concurrent group commits and releases of the members
+	struct list_head members; // Sessions of the group, linked through groupList
+	int openMembers; // Members whose session file has not been released yet
+};
+
+typedef struct sessionGroup_struct sessionGroup;
+
 #define getSessionData(FilePtr)  ((sessionData*) FilePtr->private_data)
 
+#ifndef SESSION_HAVE_ITER
 //TODO Ridefinito loff_t per aggirare il problema della define(__GNUC__) in types.h
 typedef long long loff_t;
+#endif
 
 // Current active session counter
 static atomic_t sessionCount = ATOMIC_INIT(0);
 
+// Openers waiting for a session slot, in FIFO order
+static DECLARE_WAIT_QUEUE_HEAD(admissionQueue);
+
+// If set, every session open waits for a free slot instead of failing with -EMFILE
+static int blockingAdmission = 0;
+module_param(blockingAdmission, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(blockingAdmission, "Wait for a free session slot instead of failing, for every open");
+
+// Maximum time a session open waits for its budgets and a free slot together, 0 waits forever
+static int admissionTimeoutMs = 0;
+module_param(admissionTimeoutMs, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(admissionTimeoutMs, "Maximum wait of a session open for its budgets and a free slot together, in milliseconds, 0 waits forever");
+
+// If set, every close of a session descriptor writes back the session buffer, which is otherwise written
+// back only when the last descriptor sharing the session is closed
+static int checkpointOnFlush = 0;
+module_param(checkpointOnFlush, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(checkpointOnFlush, "Write back the session buffer on every close of a session descriptor");
+
+#ifndef SESSION_HAVE_ITER
+// If set, the last release of a session moves the pages of the session buffer in the page cache instead
+// of copying them
+static int donatePages = 0;
+module_param(donatePages, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(donatePages, "Move the session buffer pages in the page cache on close instead of copying them");
+#endif
+
+// Serializes the joins, so that two sessions joining each other end up in a single group
+static DEFINE_MUTEX(groupJoinLock);
+
+// Taken for write by the group commits and for read by the copy-ins, so that a session never copies in
+// a file of a group whose commit is halfway
+static DECLARE_RWSEM(groupCommitLock);
+
+// Serialize the check of the base and the write back of the sessions on the same file, hashed by inode.
+// Taken after groupCommitLock, for read, and before the write lock. The journaled write backs of the file
+// are waited for under it, so that none is appended between the wait and the write back
+static struct mutex commitLocks[1 << COMMITLOCK_BITS];
+
+// Sessions deferring their copy-in, hashed by inode, so that a writer opening the file can find them.
+// Taken before groupCommitLock and before the write lock of the sessions. The hook on the size changes takes
+// it under the inode lock, and under the locks of a write back truncating the file: the copy-ins done under
+// it read through the page cache only, and never wait for a write back
+static DEFINE_MUTEX(deferredLock);
+static struct list_head deferredSessions[1 << DEFERRED_BITS];
+static atomic_t deferredCount = ATOMIC_INIT(0); // Number of sessions in deferredSessions
+
+// Time spent by each CPU waiting on the session locks, taken only while lockStatEnabled is set
+static DEFINE_PER_CPU(struct sessionLockStat, sessionLockStats);
+static int lockStatEnabled = 0;
+
+/*
+ * Increments the usage count unless the bad state flag is set, accounting the time spent
+ */
+static inline int _statIncUnlessSet(atomic_t *usageCountAndFlag) {
+	u64 start;
+	int ret;
+
+	if (likely(!lockStatEnabled)) {
+		return _atomicIncUnlessSet(usageCountAndFlag, BADSTATEFLAG);
+	}
+	start = local_clock();
+	ret = _atomicIncUnlessSet(usageCountAndFlag, BADSTATEFLAG);
+	this_cpu_add(sessionLockStats.usageWait, local_clock() - start);
+	return ret;
+}
+
+/*
+ * Takes the file in buffer lock in read mode, accounting the time spent
+ */
+static inline void _statDownRead(struct rw_semaphore *lock) {
+	u64 start;
+
+	if (likely(!lockStatEnabled)) {
+		down_read(lock);
+		return;
+	}
+	start = local_clock();
+	down_read(lock);
+	this_cpu_add(sessionLockStats.fileInBufferLockWait, local_clock() - start);
+}
+
+/*
+ * Takes the file in buffer lock in write mode, accounting the time spent
+ */
+static inline void _statDownWrite(struct rw_semaphore *lock) {
+	u64 start;
+
+	if (likely(!lockStatEnabled)) {
+		down_write(lock);
+		return;
+	}
+	start = local_clock();
+	down_write(lock);
+	this_cpu_add(sessionLockStats.fileInBufferLockWait, local_clock() - start);
+}
+
+/*
+ * Takes the write lock, accounting the time spent
+ */
+static inline void _statMutexLock(struct mutex *lock) {
+	u64 start;
+
+	if (likely(!lockStatEnabled)) {
+		mutex_lock(lock);
+		return;
+	}
+	start = local_clock();
+	mutex_lock(lock);
+	this_cpu_add(sessionLockStats.writeLockWait, local_clock() - start);
+}
+
 // New Session File Operations propotypes
 ssize_t sessionRead(struct file * filePtsr, char __user * buff, size_t count,
 		loff_t * pos);
@@ -68,370 +257,2809 @@ ssize_t sessionWrite(struct file * filePtr, const char __user * buff,
 		size_t count, loff_t * pos);
 loff_t sessionLlseek(struct file *filePtr, loff_t offset, int origin);
 int sessionFlush(struct file * filePtr, fl_owner_t id);
+int sessionRelease(struct inode *inode, struct file *filePtr);
+long sessionFallocate(struct file *filePtr, int mode, loff_t offset, loff_t len);
+long sessionIoctl(struct file *filePtr, unsigned int cmd, unsigned long arg);
+
+#ifdef SESSION_HAVE_ITER
+ssize_t sessionReadIter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t sessionWriteIter(struct kiocb *iocb, struct iov_iter *from);
+
+// New Session File Operations Struct, every read and write goes through the iov_iter operations
+const struct file_operations session_fops = { owner : THIS_MODULE, read_iter
+		: sessionReadIter, write_iter: sessionWriteIter, llseek: sessionLlseek, flush
+		: sessionFlush, release: sessionRelease, fallocate: sessionFallocate,
+		unlocked_ioctl: sessionIoctl, compat_ioctl: sessionIoctl, };
+#else
+// New Session File Operations Struct
+const struct file_operations session_fops = { owner : THIS_MODULE, read:sessionRead, write
+		: sessionWrite, llseek: sessionLlseek, flush: sessionFlush, release
+		: sessionRelease, fallocate: sessionFallocate, unlocked_ioctl: sessionIoctl,
+		compat_ioctl: sessionIoctl, };
+#endif
+
+/*
+ * Reads count bytes of the file at pos, for the journal
+ */
+static ssize_t _journalReadFile(struct file *filePtr, char *buffer,
+		size_t count, loff_t pos) {
+	return _readFileToBuffer(filePtr, pos, buffer, count);
+}
+
+// File accessors the journal writes and replays through
+static const struct sessionJournalOps journalOps = { read : _journalReadFile,
+		write : _writeSessionBufferToFile, truncate : _truncateFile, };
+
+/*
+ * if maxSession is less than 0, then the maximum number of sessions is set to default, if it exceeds the cap of sessions
+ * it is set to the cap value, otherwise maxSession is the maximum number of session
+ * Similarly for maxBufferOrder
+ * @maxSession: requested maximum number of sessions
+ * @bufferOrder: requested session buffer order
+ * @bufferPolicy: requested session buffer placement policy, if less than 0 the default is used
+ * @poolSize: number of free session buffers kept per NUMA node, if less than 0 the default is used
+ */
+int sessionInit(int maxSession, int bufferOrder, int bufferPolicy, int poolSize) {
+	int ret;
+	int i;
+
+	sessionBudgetInit();
+	for (i = 0; i < (1 << COMMITLOCK_BITS); i++) {
+		mutex_init(&commitLocks[i]);
+	}
+	for (i = 0; i < (1 << DEFERRED_BITS); i++) {
+		INIT_LIST_HEAD(&deferredSessions[i]);
+	}
+
+	if (maxSession > 0) {
+		maxSessionNum = min(maxSession, MAX_SESSIONNUM);
+	}
+
+	if (bufferOrder >= 0) {
+		maxBufferOrder = min(bufferOrder, MAX_BUFFERORDER);
+	}
+
+	if (bufferPolicy == SESSION_NODE_OPENER
+			|| bufferPolicy == SESSION_NODE_FIRSTACCESS) {
+		bufferNodePolicy = bufferPolicy;
+	}
+
+	if (poolSize < 0) {
+		poolSize = DEFAULT_POOLSIZE;
+	}
+
+	ret = sessionTraceInit();
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = sessionJournalInit(&journalOps);
+	if (ret < 0) {
+		sessionTraceExit();
+		return ret;
+	}
+
+	ret = sessionBufferInit(maxBufferOrder, poolSize);
+	if (ret < 0) {
+		sessionJournalExit();
+		sessionTraceExit();
+	}
+	return ret;
+}
+
+/*
+ * Changes the maximum number of sessions while the module is running. Lowering it applies to the new
+ * sessions only, the sessions exceeding it are not closed. Raising it admits the openers waiting for a slot
+ * Returns the maximum number of sessions applied, -EINVAL if maxSession is not positive
+ * @maxSession: requested maximum number of sessions, capped to MAX_SESSIONNUM
+ */
+int sessionSetMaxSession(int maxSession) {
+	int oldMaxSession = maxSessionNum;
+
+	if (maxSession <= 0) {
+		return -EINVAL;
+	}
+
+	maxSessionNum = min(maxSession, MAX_SESSIONNUM);
+	if (maxSessionNum > oldMaxSession) {
+		wake_up_nr(&admissionQueue, maxSessionNum - oldMaxSession);
+	}
+	return maxSessionNum;
+}
+
+/*
+ * Changes the session buffer order while the module is running. It applies to the new sessions only, the
+ * existing ones keep the order of their buffers. The buffer pools switch to the new order
+ * Returns the buffer order applied, -EINVAL if bufferOrder is negative
+ * @bufferOrder: requested session buffer order, capped to MAX_BUFFERORDER
+ */
+int sessionSetBufferOrder(int bufferOrder) {
+	if (bufferOrder < 0) {
+		return -EINVAL;
+	}
+
+	maxBufferOrder = min(bufferOrder, MAX_BUFFERORDER);
+	sessionBufferResize(maxBufferOrder, -1);
+	return maxBufferOrder;
+}
+
+/*
+ * Changes the number of free session buffers kept per NUMA node while the module is running
+ * Returns the pool size applied, -EINVAL if poolSize is negative
+ */
+int sessionSetPoolSize(int poolSize) {
+	if (poolSize < 0) {
+		return -EINVAL;
+	}
+
+	sessionBufferResize(maxBufferOrder, poolSize);
+	return poolSize;
+}
+
+/*
+ * Releases the resources held by the session module, called once no session exists anymore
+ */
+void sessionExit(void) {
+	sessionJournalExit();
+	sessionBufferCleanup();
+	sessionTraceExit();
+}
+
+/*
+ * Frees the session buffers and the session data, and gives back the session to its accounts
+ */
+static void _sessionFree(sessionData *sessionDataPtr) {
+	int i;
+
+	sessionBudgetUncharge(sessionDataPtr->budgets, sessionDataPtr->chargedBytes);
+	sessionBudgetRelease(sessionDataPtr->budgets);
+
+	// A buffer donated to the page cache on commit is not ours anymore
+	if (sessionDataPtr->buffer != NULL ) {
+		sessionBufferFree(sessionDataPtr->buffer, sessionDataPtr->bufferOrder);
+	}
+	for (i = 0; i < sessionDataPtr->retiredCount; i++) {
+		sessionBufferFree(sessionDataPtr->retiredBuffers[i],
+				sessionDataPtr->retiredOrders[i]);
+	}
+	mutex_destroy(&sessionDataPtr->writeLock);
+	kfree(sessionDataPtr);
+}
+
+/*
+ * Returns the smallest buffer order able to hold size bytes
+ */
+static int _sessionOrderFor(unsigned long size) {
+	if (size <= PAGE_SIZE) {
+		return 0;
+	}
+	return get_order(size);
+}
+
+/*
+ * Replaces the session buffer with a buffer of the given order allocated on the given node, copying the
+ * contents and zeroing the grown part. Called with the write lock held, so that no write gets lost on the
+ * old buffer. Reads running concurrently may still copy from the old buffer, hence it's freed now only if
+ * we are alone, otherwise it's freed on teardown. A grown buffer is charged to the accounts of the session
+ * Returns 0 on success, -ENOMEM if the new buffer can't be allocated, -EDQUOT if an account can't take it
+ */
+static int _sessionReplaceBuffer(sessionData *sessionDataPtr, int node,
+		int order) {
+	unsigned long oldSize = PAGE_SIZE << sessionDataPtr->bufferOrder;
+	unsigned long newSize = PAGE_SIZE << order;
+	char *newBuffer;
+	char *oldBuffer;
+	int ret;
+
+	if (newSize > sessionDataPtr->chargedBytes) {
+		ret = sessionBudgetCharge(sessionDataPtr->budgets,
+				newSize - sessionDataPtr->chargedBytes);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	newBuffer = sessionBufferAlloc(node, order);
+	if (newBuffer == NULL ) {
+		if (newSize > sessionDataPtr->chargedBytes) {
+			sessionBudgetUncharge(sessionDataPtr->budgets,
+					newSize - sessionDataPtr->chargedBytes);
+		}
+		return -ENOMEM;
+	}
+	if (newSize > sessionDataPtr->chargedBytes) {
+		sessionDataPtr->chargedBytes = newSize;
+	}
+
+	oldBuffer = sessionDataPtr->buffer;
+	memcpy(newBuffer, oldBuffer, min(oldSize, newSize));
+	if (newSize > oldSize) {
+		memset(&newBuffer[oldSize], 0, newSize - oldSize);
+	}
+	// The copy must be visible before the new buffer is
+	smp_wmb();
+	sessionDataPtr->buffer = newBuffer;
+
+	// The buffer only grows and migrates once, hence the retired buffers never exceed MAX_RETIREDBUFFERS
+	smp_mb();
+	if (atomic_read(&sessionDataPtr->usageCountAndFlag) == 1) {
+		sessionBufferFree(oldBuffer, sessionDataPtr->bufferOrder);
+	} else {
+		sessionDataPtr->retiredBuffers[sessionDataPtr->retiredCount] = oldBuffer;
+		sessionDataPtr->retiredOrders[sessionDataPtr->retiredCount] =
+				sessionDataPtr->bufferOrder;
+		sessionDataPtr->retiredCount++;
+	}
+	sessionDataPtr->bufferOrder = order;
+
+	return 0;
+}
+
+/*
+ * Moves the session buffer to the node of the calling CPU. Called on the first access of sessions opened
+ * with the first access placement policy
+ */
+static void _sessionMigrateBuffer(sessionData *sessionDataPtr) {
+	int node = numa_node_id();
+
+	// Only the first access migrates the buffer
+	if (xchg(&sessionDataPtr->migrateOnAccess, 0) == 0) {
+		return;
+	}
+
+	if (sessionBufferNode(sessionDataPtr->buffer) == node) {
+		return;
+	}
+
+	// On failure keep using the current buffer, it's only slower
+	mutex_lock(&sessionDataPtr->writeLock);
+	_sessionReplaceBuffer(sessionDataPtr, node, sessionDataPtr->bufferOrder);
+	mutex_unlock(&sessionDataPtr->writeLock);
+}
+
+/*
+ * Grows the session buffer so that it holds at least size bytes. Called with the write lock held
+ * Returns 0 on success, -EFBIG if the session can't grow that much, -ENOMEM if the buffer can't be allocated,
+ * -EDQUOT if the accounts of the session can't take it
+ */
+static int _sessionEnsureCapacity(sessionData *sessionDataPtr,
+		unsigned long size) {
+	if (size <= (PAGE_SIZE << sessionDataPtr->bufferOrder)) {
+		return 0;
+	}
+
+	if (size > (PAGE_SIZE << sessionDataPtr->maxOrder)) {
+		return -EFBIG;
+	}
+
+	return _sessionReplaceBuffer(sessionDataPtr,
+			sessionBufferNode(sessionDataPtr->buffer), _sessionOrderFor(size));
+}
+
+/*
+ * Reserves count session slots in one shot, either all of them or none
+ * Returns 0 on success, -EMFILE if the sessions would exceed the maximum number of sessions
+ * @count: number of slots to reserve
+ */
+int sessionReserve(int count) {
+	if (_atomicAddUnlessExceeds(&sessionCount, count, maxSessionNum) < 0) {
+		printk(KERN_WARNING "Too many session opened\n");
+		return -EMFILE;
+	}
+	return 0;
+}
+
+/*
+ * Gives back count session slots previously taken with sessionReserve and not used by any session
+ * @count: number of slots to release
+ */
+void sessionUnreserve(int count) {
+	atomic_sub(count, &sessionCount);
+	wake_up_nr(&admissionQueue, count);
+}
+
+/*
+ * Takes a session slot. If none is available and waiting has been requested, sleeps until a session
+ * teardown hands over its slot. Sleepers are woken one per teardown, oldest first
+ * Returns 0 on success, -EMFILE if no slot became available, -EINTR if interrupted by a signal
+ * @wait: true to wait for a slot
+ * @timeout: maximum wait in jiffies, MAX_SCHEDULE_TIMEOUT to wait forever
+ */
+static int _sessionAdmit(int wait, long timeout) {
+	DECLARE_WAITQUEUE(waiter, current);
+	int ret = 0;
+
+	// Newcomers must not overtake the openers already waiting
+	if (!waitqueue_active(&admissionQueue)
+			&& _atomicAddUnlessExceeds(&sessionCount, 1, maxSessionNum) >= 0) {
+		return 0;
+	}
+
+	if (!wait) {
+		printk(KERN_WARNING "Too many session opened\n");
+		return -EMFILE;
+	}
+
+	// The waiter stays queued until it leaves, so that a wake up lost to a newcomer keeps its position
+	add_wait_queue_exclusive(&admissionQueue, &waiter);
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (_atomicAddUnlessExceeds(&sessionCount, 1, maxSessionNum) >= 0) {
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		if (timeout == 0) {
+			printk(KERN_WARNING "Too many session opened\n");
+			ret = -EMFILE;
+			break;
+		}
+		timeout = schedule_timeout(timeout);
+	}
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&admissionQueue, &waiter);
+
+	// Leaving without a slot may have consumed the wake up meant for the next waiter
+	if (ret < 0 && atomic_read(&sessionCount) < maxSessionNum) {
+		wake_up(&admissionQueue);
+	}
+
+	return ret;
+}
+
+/*
+ * Gives back the slot of a session being torn down, waking the oldest waiting opener
+ */
+static void _sessionRelease(void) {
+	atomic_dec(&sessionCount);
+	wake_up(&admissionQueue);
+}
+
+/*
+ * Starts the read of the file contents in the page cache without waiting for it, so that the following
+ * sessionOpenReserved copies in from memory. Used to overlap the copy-ins of a batch of sessions
+ * @filePtr: a pointer to a file struct
+ */
+void sessionPrefetch(struct file *filePtr) {
+	struct address_space *mapping = filePtr->f_mapping;
+	unsigned long pages;
+
+	if (!_mappingCanReadPages(mapping)) {
+		return;
+	}
+
+	pages = (i_size_read(_fileInode(filePtr)) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	if (pages > 0) {
+		page_cache_sync_readahead(mapping, &filePtr->f_ra, filePtr, 0, pages);
+	}
+}
+
+/*
+ * Copies count bytes of the file, starting from start, at the same offset of the buffer.
+ * The contents are taken page by page straight from the page cache, falling back to kernel_read for
+ * files without an address_space able to read pages.
+ * Returns the number of bytes copied, or a negative error
+ * @filePtr: a pointer to a file struct
+ * @buffer: the session buffer
+ * @start: offset of the first byte to copy
+ * @count: number of bytes to copy
+ */
+static ssize_t _loadFileRange(struct file *filePtr, char *buffer,
+		unsigned long start, unsigned long count) {
+	struct address_space *mapping = filePtr->f_mapping;
+	struct page *page;
+	char *pageAddr;
+	unsigned long offset = start;
+	unsigned long end = start + count;
+	unsigned long pageOffset;
+	unsigned long chunk;
+	ssize_t readenBytes;
+
+	if (_mappingCanReadPages(mapping)) {
+		while (offset < end) {
+			// Returns the uptodate page, reading it if it is not cached
+			page = read_mapping_page(mapping, offset >> PAGE_CACHE_SHIFT,
+					filePtr);
+			if (IS_ERR(page)) {
+				return PTR_ERR(page);
+			}
+
+			pageOffset = offset & (PAGE_CACHE_SIZE - 1);
+			chunk = min(end - offset, PAGE_CACHE_SIZE - pageOffset);
+			pageAddr = kmap_atomic(page);
+			memcpy(&buffer[offset], pageAddr + pageOffset, chunk);
+			kunmap_atomic(pageAddr);
+			page_cache_release(page);
+
+			offset += chunk;
+		}
+	} else {
+		do {
+			readenBytes = _readFileToBuffer(filePtr, offset, &buffer[offset],
+					end - offset);
+			if (readenBytes < 0) {
+				return readenBytes;
+			}
+			offset += readenBytes;
+		} while (offset < end && readenBytes > 0);
+	}
+
+	return offset - start;
+}
+
+/*
+ * Copies the first count bytes of the file in the buffer, and zeroes the rest of the buffer.
+ * Returns the number of bytes copied, or a negative error
+ * @filePtr: a pointer to a file struct
+ * @buffer: the session buffer
+ * @count: number of bytes to copy
+ * @bufferSize: size of the session buffer
+ */
+static ssize_t _loadSessionBuffer(struct file *filePtr, char *buffer,
+		unsigned long count, unsigned long bufferSize) {
+	ssize_t readenBytes;
+
+	readenBytes = _loadFileRange(filePtr, buffer, 0, count);
+	if (readenBytes < 0) {
+		return readenBytes;
+	}
+
+	// Only the part of the buffer past the end of file has to be zeroed
+	memset(&buffer[readenBytes], 0, bufferSize - readenBytes);
+
+	return readenBytes;
+}
+
+/*
+ * Hashes a page sized block of the session buffer
+ */
+static inline u32 _sessionBlockHash(const char *block) {
+	return jhash2((const u32*) block, PAGE_CACHE_SIZE / sizeof(u32), 0);
+}
+
+/*
+ * Takes the hash of every block of the buffer holding file contents, so that the commit can tell which
+ * blocks did not change
+ */
+static void _sessionHashBlocks(sessionData *sessionDataPtr, unsigned long size) {
+	unsigned long blocks = DIV_ROUND_UP(size, PAGE_CACHE_SIZE);
+	unsigned long block;
+
+	sessionDataPtr->hashedBlocks = 0;
+	for (block = 0; block < blocks; block++) {
+		sessionDataPtr->blockHash[block] = _sessionBlockHash(
+				&sessionDataPtr->buffer[block << PAGE_CACHE_SHIFT]);
+		__set_bit(block, &sessionDataPtr->hashedBlocks);
+	}
+}
+
+/*
+ * Copies in the file contents of the blocks touched by a write of count bytes at pos, for the sessions that
+ * skipped the copy-in at open. Blocks entirely covered by the write are not read but only marked as loaded,
+ * and returned in skipped, so that _sessionFinishWrite can fill in what a short write did not cover.
+ * Called with the write lock held
+ * Returns 0 on success, or a negative error
+ * @filePtr: a pointer to a file struct
+ * @sessionDataPtr: the session
+ * @pos: offset of the write
+ * @count: length of the write, not zero
+ * @skipped: returns the mask of the blocks marked as loaded without reading them
+ */
+static int _sessionPrepareWrite(struct file *filePtr,
+		sessionData *sessionDataPtr, unsigned long pos, unsigned long count,
+		unsigned long *skipped) {
+	unsigned long block;
+	unsigned long start;
+	ssize_t ret;
+
+	*skipped = 0;
+
+	// Every block is loaded unless the copy-in has been skipped
+	if (likely(sessionDataPtr->loadedBlocks == ~0UL)) {
+		return 0;
+	}
+
+	for (block = pos >> PAGE_CACHE_SHIFT;
+			block <= (pos + count - 1) >> PAGE_CACHE_SHIFT; block++) {
+		if (test_bit(block, &sessionDataPtr->loadedBlocks)) {
+			continue;
+		}
+
+		start = block << PAGE_CACHE_SHIFT;
+		if (pos <= start && pos + count >= start + PAGE_CACHE_SIZE) {
+			*skipped |= 1UL << block;
+		} else {
+			// Blocks are left unloaded only below the loadable size
+			ret = _loadFileRange(filePtr, sessionDataPtr->buffer, start,
+					min(sessionDataPtr->loadableSize - start,
+							(unsigned long) PAGE_CACHE_SIZE));
+			if (ret < 0) {
+				return ret;
+			}
+			memset(&sessionDataPtr->buffer[start + ret], 0, PAGE_CACHE_SIZE - ret);
+
+			sessionDataPtr->blockHash[block] = _sessionBlockHash(
+					&sessionDataPtr->buffer[start]);
+			__set_bit(block, &sessionDataPtr->hashedBlocks);
+		}
+		__set_bit(block, &sessionDataPtr->loadedBlocks);
+	}
+
+	return 0;
+}
+
+/*
+ * Fills in, from the file, the part of the skipped blocks that a short write did not cover. Called with
+ * the write lock held
+ * @filePtr: a pointer to a file struct
+ * @sessionDataPtr: the session
+ * @end: offset of the end of the written bytes
+ * @skipped: mask of the blocks returned by _sessionPrepareWrite
+ */
+static void _sessionFinishWrite(struct file *filePtr,
+		sessionData *sessionDataPtr, unsigned long end, unsigned long skipped) {
+	unsigned long block;
+	unsigned long start;
+	unsigned long stop;
+	ssize_t ret;
+
+	for (block = 0; skipped != 0; block++, skipped >>= 1) {
+		stop = (block + 1) << PAGE_CACHE_SHIFT;
+		if (!(skipped & 1) || end >= stop) {
+			continue;
+		}
+
+		start = max(block << PAGE_CACHE_SHIFT, end);
+		memset(&sessionDataPtr->buffer[start], 0, stop - start);
+		if (start < sessionDataPtr->loadableSize) {
+			ret = _loadFileRange(filePtr, sessionDataPtr->buffer, start,
+					min(sessionDataPtr->loadableSize, stop) - start);
+			if (ret < 0) {
+				// Leaves the file block untouched on commit, the written bytes are lost
+				printk(KERN_WARNING "Can't load session block %lu\n", block);
+				__clear_bit(block, &sessionDataPtr->loadedBlocks);
+			}
+		}
+	}
+}
+
+/*
+ * Returns true if the metadata of the file moved since the session recorded its base
+ */
+static int _sessionBaseMoved(struct inode *inode, sessionData *sessionDataPtr) {
+	sessionStamp mtime = _inodeMtime(inode);
+	sessionStamp ctime = _inodeCtime(inode);
+
+	if (i_size_read(inode) != sessionDataPtr->baseSize) {
+		return 1;
+	}
+	if (IS_I_VERSION(inode)) {
+		return _inodeVersion(inode) != sessionDataPtr->baseVersion;
+	}
+	return _stampCompare(&mtime, &sessionDataPtr->baseMtime) != 0
+			|| _stampCompare(&ctime, &sessionDataPtr->baseCtime) != 0;
+}
+
+/*
+ * Returns true if the metadata of the file prove that it did not change since the session recorded its base.
+ * The times can't prove it when the file changed in the same tick the base was recorded, and nothing can
+ * when the base is compared on the contents
+ */
+static int _sessionBaseHeld(struct inode *inode, sessionData *sessionDataPtr) {
+	return !sessionDataPtr->baseByContent
+			&& !_sessionBaseMoved(inode, sessionDataPtr)
+			&& (IS_I_VERSION(inode)
+					|| _stampCompare(&sessionDataPtr->baseMtime,
+							&sessionDataPtr->baseTaken) < 0);
+}
+
+/*
+ * Returns true if the block of the session buffer holds the same bytes the file holds now.
+ * The hash taken at copy-in rules out most of the changed blocks without touching the file, the blocks
+ * that look unchanged are compared against the page cache, since the file may have been written meanwhile.
+ * A block out of the page cache is taken as changed, unless the session dropped it itself after writing it
+ * and the file did not change since
+ * @filePtr: a pointer to a file struct
+ * @sessionDataPtr: the session
+ * @block: index of the block
+ * @size: size of the session file
+ */
+static int _sessionBlockUnchanged(struct file *filePtr,
+		sessionData *sessionDataPtr, unsigned long block, unsigned long size) {
+	struct address_space *mapping = filePtr->f_mapping;
+	unsigned long start = block << PAGE_CACHE_SHIFT;
+	unsigned long length = min_t(unsigned long, size - start, PAGE_CACHE_SIZE);
+	struct page *page;
+	char *pageAddr;
+	int unchanged;
+
+	// Blocks never copied in hold the file contents by definition
+	if (!test_bit(block, &sessionDataPtr->loadedBlocks)) {
+		return 1;
+	}
+
+	if (!test_bit(block, &sessionDataPtr->hashedBlocks)) {
+		return 0;
+	}
+
+	if (_sessionBlockHash(&sessionDataPtr->buffer[start])
+			!= sessionDataPtr->blockHash[block]) {
+		return 0;
+	}
+
+	if (start + length > i_size_read(mapping->host)) {
+		return 0;
+	}
+
+	// Reading the block back from disk would cost more than writing it, only cached pages are compared
+	page = find_get_page(mapping, block);
+	if (page == NULL ) {
+		// Another writer may have changed the block and let its page go, only the base can rule it out
+		return test_bit(block, &sessionDataPtr->droppedBlocks)
+				&& _sessionBaseHeld(mapping->host, sessionDataPtr);
+	}
+	if (!PageUptodate(page)) {
+		page_cache_release(page);
+		return 0;
+	}
+
+	pageAddr = kmap_atomic(page);
+	unchanged = (memcmp(pageAddr, &sessionDataPtr->buffer[start], length) == 0);
+	kunmap_atomic(pageAddr);
+	page_cache_release(page);
+
+	return unchanged;
+}
+
+/*
+ * Writes length bytes of the buffer, starting from start, at the same offset of the file
+ */
+static int _sessionWriteRange(struct file *filePtr, const char *buffer,
+		loff_t start, size_t length) {
+	ssize_t ret;
+
+	while (length > 0) {
+		ret = _writeSessionBufferToFile(filePtr, &buffer[start], length, start);
+		if (ret < 0) {
+			return ret;
+		}
+		if (ret == 0) {
+			return -EIO;
+		}
+		start += ret;
+		length -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the range out to the disk and drops its pages from the page cache, so that the committed contents
+ * are not kept both in the session buffer and in the page cache. Pages mapped by someone are left cached
+ */
+static int _dropCachedRange(struct file *filePtr, loff_t start, loff_t stop) {
+	struct address_space *mapping = filePtr->f_mapping;
+	int ret;
+
+	ret = filemap_write_and_wait_range(mapping, start, stop - 1);
+	if (ret < 0) {
+		return ret;
+	}
+
+	invalidate_mapping_pages(mapping, start >> PAGE_CACHE_SHIFT,
+			(stop - 1) >> PAGE_CACHE_SHIFT);
+	return 0;
+}
+
+/*
+ * Writes back the session buffer to the file. Only the runs of blocks whose contents differ from the file
+ * are written, and the file is truncated only if its size differs from the size of the session file.
+ * Sessions opened with SESSION_HINT_NOCACHE flush the written range and drop it from the page cache.
+ * Given a journal transaction, the runs are added to it instead, and the file is written once applied
+ * @filePtr: a pointer to a file struct, using the original file operations
+ * @sessionDataPtr: the session
+ * @txn: the journal transaction, or NULL to write the file
+ */
+static int _commitSessionBuffer(struct file *filePtr,
+		sessionData *sessionDataPtr, sessionJournalTxn *txn) {
+	unsigned long size = sessionDataPtr->fileInBufferSize;
+	unsigned long blocks = DIV_ROUND_UP(size, PAGE_CACHE_SIZE);
+	unsigned long block = 0;
+	unsigned long end;
+	loff_t start;
+	loff_t stop;
+	loff_t writtenStart = -1;
+	loff_t writtenStop = 0;
+	struct file *txnFilePtr;
+	int ret;
+
+	// The transaction outlives the session file, it writes through a file of its own
+	if (txn != NULL) {
+		txnFilePtr = _openFileForWrite(filePtr);
+		if (IS_ERR(txnFilePtr)) {
+			return PTR_ERR(txnFilePtr);
+		}
+		ret = sessionJournalAddFile(txn, txnFilePtr, size);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	while (block < blocks) {
+		if (_sessionBlockUnchanged(filePtr, sessionDataPtr, block, size)) {
+			block++;
+			continue;
+		}
+
+		// Coalesce the following changed blocks in a single write
+		for (end = block + 1;
+				end < blocks
+						&& !_sessionBlockUnchanged(filePtr, sessionDataPtr,
+								end, size); end++)
+			;
+
+		start = (loff_t) block << PAGE_CACHE_SHIFT;
+		stop = min_t(loff_t, (loff_t) end << PAGE_CACHE_SHIFT, size);
+		if (txn != NULL) {
+			ret = sessionJournalAddExtent(txn, &sessionDataPtr->buffer[start],
+					start, stop - start);
+		} else {
+			ret = _sessionWriteRange(filePtr, sessionDataPtr->buffer, start,
+					stop - start);
+		}
+		if (ret < 0) {
+			return ret;
+		}
+		if (writtenStart < 0) {
+			writtenStart = start;
+		}
+		writtenStop = stop;
+		block = end;
+	}
+
+	// The journal truncates the file when applying the transaction
+	if (txn != NULL) {
+		return 0;
+	}
+
+	if (sessionDataPtr->noCache && writtenStart >= 0) {
+		ret = _dropCachedRange(filePtr, writtenStart, writtenStop);
+		if (ret < 0) {
+			return ret;
+		}
+		// The file holds the session buffer over the whole range dropped
+		for (block = writtenStart >> PAGE_CACHE_SHIFT;
+				block < DIV_ROUND_UP(writtenStop, PAGE_CACHE_SIZE); block++) {
+			__set_bit(block, &sessionDataPtr->droppedBlocks);
+		}
+	}
+
+	// The writes above already extended the file if the session file is larger, hence we must truncate
+	// only if the session file is smaller
+	if (size < i_size_read(_fileInode(filePtr))) {
+		ret = _truncateFile(filePtr, size);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+#ifndef SESSION_HAVE_ITER
+/*
+ * Writes a page of the session buffer at pos through the write_begin and write_end of the filesystem, as
+ * generic_perform_write does. The page is first put in the page cache in place of the cached one, so that
+ * write_begin finds it already uptodate and nothing is copied. If the cached page can't be replaced, since
+ * someone maps it or is writing it, the contents are copied in the page returned by write_begin.
+ * Called with i_mutex held, on a session buffer split in order 0 pages
+ * @filePtr: a pointer to a file struct, using the original file operations
+ * @page: the page of the session buffer, which keeps its own reference
+ * @pos: offset of the page in the file
+ * @len: bytes of the page holding file contents
+ */
+static int _writeSessionPage(struct file *filePtr, struct page *page,
+		loff_t pos, unsigned len) {
+	struct address_space *mapping = filePtr->f_mapping;
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	struct page *oldPage;
+	struct page *writtenPage;
+	void *fsdata;
+	char *pageAddr;
+	int donated = 0;
+	int ret;
+
+	oldPage = find_lock_page(mapping, index);
+	if (oldPage != NULL ) {
+		if (!page_mapped(oldPage) && !PageDirty(oldPage) && !PageWriteback(oldPage)
+				&& (!page_has_private(oldPage)
+						|| try_to_release_page(oldPage, GFP_KERNEL))) {
+			delete_from_page_cache(oldPage);
+		}
+		unlock_page(oldPage);
+		page_cache_release(oldPage);
+	}
+
+	// Fails if the old page is still there, or someone cached the page again meanwhile
+	if (add_to_page_cache_lru(page, mapping, index, GFP_KERNEL) == 0) {
+		SetPageUptodate(page);
+		unlock_page(page);
+		donated = 1;
+	}
+
+	ret = pagecache_write_begin(filePtr, mapping, pos, len,
+			AOP_FLAG_UNINTERRUPTIBLE, &writtenPage, &fsdata);
+	if (ret < 0) {
+		// The donated page must not show contents that are not being written
+		if (donated) {
+			lock_page(page);
+			if (page->mapping == mapping) {
+				delete_from_page_cache(page);
+			}
+			unlock_page(page);
+		}
+		return ret;
+	}
+
+	if (writtenPage != page) {
+		pageAddr = kmap_atomic(writtenPage);
+		memcpy(pageAddr, page_address(page), len);
+		kunmap_atomic(pageAddr);
+		flush_dcache_page(writtenPage);
+	}
+
+	ret = pagecache_write_end(filePtr, mapping, pos, len, len, writtenPage,
+			fsdata);
+	if (ret < 0) {
+		return ret;
+	}
+	if (ret < len) {
+		return -EIO;
+	}
+
+	balance_dirty_pages_ratelimited(mapping);
+	return 0;
+}
+
+/*
+ * Writes back the session buffer moving its pages in the page cache instead of copying them. Only the
+ * blocks whose contents differ from the file are written, as in _commitSessionBuffer. The buffer is split in
+ * order 0 pages, hence this is done only on the last release: every page gets its own reference, dropped
+ * at the end, so that the donated pages live on in the page cache and the others are freed. The session
+ * buffer is left NULL
+ * @filePtr: a pointer to a file struct, using the original file operations
+ * @sessionDataPtr: the session
+ */
+static int _commitSessionBufferDonating(struct file *filePtr,
+		sessionData *sessionDataPtr) {
+	struct inode *inode = _fileInode(filePtr);
+	unsigned long size = sessionDataPtr->fileInBufferSize;
+	unsigned long blocks = DIV_ROUND_UP(size, PAGE_CACHE_SIZE);
+	unsigned long pages = 1UL << sessionDataPtr->bufferOrder;
+	struct page *firstPage = virt_to_page(sessionDataPtr->buffer);
+	unsigned long block;
+	unsigned long start;
+	int ret = 0;
+
+	split_page(firstPage, sessionDataPtr->bufferOrder);
+
+	mutex_lock(&inode->i_mutex);
+	ret = file_remove_suid(filePtr);
+	if (ret == 0) {
+		file_update_time(filePtr);
+	}
+	for (block = 0; ret == 0 && block < blocks; block++) {
+		if (_sessionBlockUnchanged(filePtr, sessionDataPtr, block, size)) {
+			continue;
+		}
+		start = block << PAGE_CACHE_SHIFT;
+		ret = _writeSessionPage(filePtr, firstPage + block, start,
+				min(size - start, (unsigned long) PAGE_CACHE_SIZE));
+	}
+	mutex_unlock(&inode->i_mutex);
+
+	// Must come after the writes, which still read the buffer
+	for (block = 0; block < pages; block++) {
+		page_cache_release(firstPage + block);
+	}
+	sessionDataPtr->buffer = NULL;
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	// As in _commitSessionBuffer, the writes already extended the file if the session file is larger
+	if (size < i_size_read(inode)) {
+		ret = _truncateFile(filePtr, size);
+	}
+	return ret;
+}
+#endif
+
+/*
+ * Writes back the session buffer through the journal: the changed runs are on the disk once this returns, and
+ * reach the file in the background
+ */
+static int _commitSessionBufferJournaled(struct file *filePtr,
+		sessionData *sessionDataPtr) {
+	sessionJournalTxn *txn;
+	int ret;
+
+	txn = sessionJournalBegin();
+	if (txn == NULL ) {
+		return -ENOMEM;
+	}
+
+	ret = _commitSessionBuffer(filePtr, sessionDataPtr, txn);
+	if (ret < 0) {
+		sessionJournalAbort(txn);
+		return ret;
+	}
+	return sessionJournalCommit(txn);
+}
+
+/*
+ * Writes back the session buffer on the last release of the session. The pages are moved in the page cache
+ * if requested and possible, otherwise copied
+ */
+static int _commitSessionBufferOnRelease(struct file *filePtr,
+		sessionData *sessionDataPtr) {
+	// The journal keeps its own copy of the changed runs
+	if (sessionJournalEnabled) {
+		return _commitSessionBufferJournaled(filePtr, sessionDataPtr);
+	}
+#ifndef SESSION_HAVE_ITER
+	// write_begin and write_end are the only way to have the filesystem account the donated pages, and the
+	// pages would be dropped right after by a session committing without caching
+	if (donatePages && !sessionDataPtr->noCache
+			&& filePtr->f_mapping->a_ops->write_begin != NULL) {
+		return _commitSessionBufferDonating(filePtr, sessionDataPtr);
+	}
+#endif
+	return _commitSessionBuffer(filePtr, sessionDataPtr, NULL);
+}
+
+/*
+ * Records the state of the file the session is based on. Called before the copy-in, so that a change racing
+ * with the copy-in shows up as a change of the base
+ */
+static void _sessionRecordBase(struct file *filePtr,
+		sessionData *sessionDataPtr) {
+	struct inode *inode = _fileInode(filePtr);
+
+	sessionDataPtr->baseSize = i_size_read(inode);
+	sessionDataPtr->baseVersion = _inodeVersion(inode);
+	sessionDataPtr->baseMtime = _inodeMtime(inode);
+	sessionDataPtr->baseCtime = _inodeCtime(inode);
+	sessionDataPtr->baseTaken = _currentTime(inode);
+	sessionDataPtr->baseByContent = 0;
+	sessionDataPtr->baseChecksumValid = 0;
+}
+
+/*
+ * Takes the checksum of the file contents copied in from the block hashes, after the copy-in. A session
+ * that skipped the copy-in of some block has no checksum
+ * @sessionDataPtr: the session
+ * @size: size of the file contents copied in
+ */
+static void _sessionRecordChecksum(sessionData *sessionDataPtr,
+		unsigned long size) {
+	if (sessionDataPtr->loadedBlocks != ~0UL) {
+		sessionDataPtr->baseChecksumValid = 0;
+		return;
+	}
+
+	sessionDataPtr->baseChecksum = jhash2(sessionDataPtr->blockHash,
+			DIV_ROUND_UP(size, PAGE_CACHE_SIZE), 0);
+	sessionDataPtr->baseChecksumValid = 1;
+}
+
+/*
+ * Records the file as just written back by the session as its new base, after the block hashes have been
+ * taken again. A journaled write back reaches the file later, moving its metadata, hence only the size and
+ * the checksum of the contents written are recorded, and the base is compared on the contents
+ */
+static void _sessionRebase(struct file *filePtr, sessionData *sessionDataPtr) {
+	_sessionRecordBase(filePtr, sessionDataPtr);
+	if (sessionJournalEnabled) {
+		sessionDataPtr->baseSize = sessionDataPtr->fileInBufferSize;
+		sessionDataPtr->baseByContent = 1;
+	}
+	_sessionRecordChecksum(sessionDataPtr, sessionDataPtr->fileInBufferSize);
+}
+
+/*
+ * Takes the checksum of the first size bytes of the file as _sessionRecordChecksum does, reading them
+ * through the page cache
+ * Returns 0 on success, or a negative error
+ */
+static int _sessionFileChecksum(struct file *filePtr, unsigned long size,
+		u32 *checksum) {
+	struct address_space *mapping = filePtr->f_mapping;
+	unsigned long blocks = DIV_ROUND_UP(size, PAGE_CACHE_SIZE);
+	unsigned long block;
+	unsigned long length;
+	u32 hashes[MAX_PAGENUM];
+	struct page *page;
+	char *pageAddr;
+	char *scratch;
+
+	if (!_mappingCanReadPages(mapping) || blocks > MAX_PAGENUM) {
+		return -EOPNOTSUPP;
+	}
+
+	scratch = (char*) __get_free_page(GFP_KERNEL);
+	if (scratch == NULL ) {
+		return -ENOMEM;
+	}
+
+	for (block = 0; block < blocks; block++) {
+		page = read_mapping_page(mapping, block, filePtr);
+		if (IS_ERR(page)) {
+			free_page((unsigned long) scratch);
+			return PTR_ERR(page);
+		}
+
+		length = min_t(unsigned long, size - (block << PAGE_CACHE_SHIFT),
+				PAGE_CACHE_SIZE);
+		pageAddr = kmap_atomic(page);
+		memcpy(scratch, pageAddr, length);
+		kunmap_atomic(pageAddr);
+		page_cache_release(page);
+
+		// The block hashes are taken on the session buffer, which is zeroed past the end of file
+		memset(&scratch[length], 0, PAGE_CACHE_SIZE - length);
+		hashes[block] = _sessionBlockHash(scratch);
+	}
+
+	free_page((unsigned long) scratch);
+	*checksum = jhash2(hashes, blocks, 0);
+	return 0;
+}
+
+/*
+ * Returns true if the file changed since the session recorded its base. The version, or the times when the
+ * filesystem does not keep a version, rule out a change cheaply. When they moved, or when they can't be
+ * trusted since the file changed in the same tick the base was recorded or a journaled write back is still
+ * to reach the file, the contents are compared
+ * @filePtr: a pointer to a file struct on the session file
+ * @sessionDataPtr: the session
+ */
+static int _sessionBaseChanged(struct file *filePtr,
+		sessionData *sessionDataPtr) {
+	struct inode *inode = _fileInode(filePtr);
+	u32 checksum;
+
+	if (i_size_read(inode) != sessionDataPtr->baseSize) {
+		return 1;
+	}
+
+	if (_sessionBaseHeld(inode, sessionDataPtr)) {
+		return 0;
+	}
+
+	// Without a checksum any doubt is a conflict, the caller can refresh and retry
+	if (!sessionDataPtr->baseChecksumValid
+			|| _sessionFileChecksum(filePtr, sessionDataPtr->baseSize,
+					&checksum) < 0) {
+		return 1;
+	}
+	return checksum != sessionDataPtr->baseChecksum;
+}
+
+/*
+ * Returns the lock serializing the write backs of the sessions on the inode
+ */
+static inline struct mutex* _commitLockFor(struct inode *inode) {
+	return &commitLocks[hash_ptr(inode, COMMITLOCK_BITS)];
+}
+
+/*
+ * Fills the session buffer with the first count bytes of the file, zeroing the rest of it. A lazy
+ * population copies nothing, the file contents are copied in only for the blocks partially written
+ * Returns the size of the session file, or a negative error
+ * @filePtr: a pointer to a file struct
+ * @sessionDataPtr: the session
+ * @count: number of bytes of the file to hold, not exceeding the session buffer
+ * @lazy: true if the session never reads
+ */
+static ssize_t _sessionPopulate(struct file *filePtr,
+		sessionData *sessionDataPtr, unsigned long count, int lazy) {
+	unsigned long bufferSize = PAGE_SIZE << sessionDataPtr->bufferOrder;
+	unsigned long loaded;
+	ssize_t readenBytes;
+
+	sessionDataPtr->loadedBlocks = ~0UL;
+	sessionDataPtr->loadableSize = 0;
+
+	if (lazy) {
+		loaded = DIV_ROUND_UP(count, PAGE_CACHE_SIZE);
+		sessionDataPtr->loadedBlocks <<= loaded;
+		sessionDataPtr->loadableSize = count;
+		sessionDataPtr->hashedBlocks = 0;
+		memset(&sessionDataPtr->buffer[loaded << PAGE_CACHE_SHIFT], 0,
+				bufferSize - (loaded << PAGE_CACHE_SHIFT));
+		return count;
+	}
+
+	readenBytes = _loadSessionBuffer(filePtr, sessionDataPtr->buffer, count,
+			bufferSize);
+	if (readenBytes < 0) {
+		return readenBytes;
+	}
+	_sessionHashBlocks(sessionDataPtr, readenBytes);
+
+	return readenBytes;
+}
+
+/*
+ * Removes the session from the sessions deferring their copy-in. Called with deferredLock held
+ */
+static void _sessionUnregisterDeferred(sessionData *sessionDataPtr) {
+	if (!list_empty(&sessionDataPtr->deferredList)) {
+		list_del_init(&sessionDataPtr->deferredList);
+		atomic_dec(&deferredCount);
+	}
+}
+
+/*
+ * Copies in the file contents of a session that deferred it, before the file gets written. The writers of
+ * the file are all hooked, hence the file is still the one the session opened. If the copy-in fails the
+ * session stays deferred, but the file may change from now on: it is not tried again, and the reads fail
+ * with its error. Called with deferredLock held, the session is unregistered anyway
+ * Returns 0 on success, or a negative error
+ */
+static int _sessionMaterializeLocked(sessionData *sessionDataPtr) {
+	struct file *filePtr = sessionDataPtr->filePtr;
+	ssize_t readenBytes = 0;
+
+	_sessionUnregisterDeferred(sessionDataPtr);
+
+	mutex_lock(&sessionDataPtr->writeLock);
+	if (!sessionDataPtr->deferred) {
+		goto out;
+	}
+
+	if (sessionDataPtr->deferredError < 0) {
+		readenBytes = sessionDataPtr->deferredError;
+		goto out;
+	}
+
+	// Reads served from the page cache are done once they release the size lock
+	_statDownWrite(&sessionDataPtr->fileInBufferLock);
+	readenBytes = _sessionPopulate(filePtr, sessionDataPtr,
+			sessionDataPtr->fileInBufferSize, 0);
+	if (readenBytes >= 0) {
+		sessionDataPtr->fileInBufferSize = readenBytes;
+		_sessionRecordChecksum(sessionDataPtr, readenBytes);
+		sessionDataPtr->deferred = 0;
+	} else {
+		sessionDataPtr->deferredError = readenBytes;
+	}
+	up_write(&sessionDataPtr->fileInBufferLock);
+
+out:
+	mutex_unlock(&sessionDataPtr->writeLock);
+	return readenBytes < 0 ? readenBytes : 0;
+}
+
+/*
+ * Copies in the file contents of a session that deferred it, before the session writes
+ */
+static int _sessionMaterialize(sessionData *sessionDataPtr) {
+	int ret;
+
+	mutex_lock(&deferredLock);
+	ret = _sessionMaterializeLocked(sessionDataPtr);
+	mutex_unlock(&deferredLock);
+	return ret;
+}
+
+/*
+ * Copies in the file contents of every session deferring it on the inode, before someone writes the file.
+ * Must be called without holding the locks of the sessions deferring their copy-in
+ */
+static void _sessionMaterializeInode(struct inode *inode) {
+	struct list_head *sessions = &deferredSessions[hash_ptr(inode, DEFERRED_BITS)];
+	sessionData *sessionDataPtr;
+	sessionData *next;
+
+	if (likely(atomic_read(&deferredCount) == 0)) {
+		return;
+	}
+
+	mutex_lock(&deferredLock);
+	list_for_each_entry_safe(sessionDataPtr, next, sessions, deferredList) {
+		if (_fileInode(sessionDataPtr->filePtr) == inode
+				&& _sessionMaterializeLocked(sessionDataPtr) < 0) {
+			printk(KERN_WARNING "Can't copy in a deferred session, its reads will fail\n");
+		}
+	}
+	mutex_unlock(&deferredLock);
+}
+
+/*
+ * Reloads the session buffer from the file, reusing the buffer when the file still fits in it. Reads
+ * running concurrently may return a mix of the old and the new contents, as they do against writes
+ */
+static int _sessionRefresh(struct file *filePtr, sessionData *sessionDataPtr) {
+	unsigned long count;
+	ssize_t readenBytes;
+	int ret;
+
+	// The write backs journaled so far are part of the file
+	ret = sessionJournalSync(_fileInode(filePtr));
+	if (ret < 0) {
+		return ret;
+	}
+	count = i_size_read(_fileInode(filePtr));
+
+	// A deferring session copies in the file as it is now, the writers don't need to care anymore
+	if (sessionDataPtr->deferred) {
+		mutex_lock(&deferredLock);
+		_sessionUnregisterDeferred(sessionDataPtr);
+		mutex_unlock(&deferredLock);
+	}
+
+	// Taken before the write lock, as the group commits do
+	down_read(&groupCommitLock);
+	mutex_lock(&sessionDataPtr->writeLock);
+
+	ret = _sessionEnsureCapacity(sessionDataPtr, count);
+	if (ret < 0) {
+		goto out;
+	}
+
+	_sessionRecordBase(filePtr, sessionDataPtr);
+	readenBytes = _sessionPopulate(filePtr, sessionDataPtr, count,
+			(filePtr->f_flags & O_ACCMODE) == O_WRONLY);
+	if (readenBytes < 0) {
+		ret = readenBytes;
+		goto out;
+	}
+	_sessionRecordChecksum(sessionDataPtr, readenBytes);
+
+	_statDownWrite(&sessionDataPtr->fileInBufferLock);
+	sessionDataPtr->fileInBufferSize = readenBytes;
+	sessionDataPtr->deferred = 0;
+	up_write(&sessionDataPtr->fileInBufferLock);
+
+out:
+	mutex_unlock(&sessionDataPtr->writeLock);
+	up_read(&groupCommitLock);
+	return ret;
+}
+
+/*
+ * Reads count bytes at pos of a session deferring its copy-in from the page cache. Called with the size lock
+ * held for read, which keeps the copy-in, hence the writers opening the file, waiting
+ * Returns the number of bytes read, the error of a failed copy-in, or another negative error
+ */
+static ssize_t _sessionReadDeferred(struct file *filePtr,
+		sessionData *sessionDataPtr, char __user *buff, loff_t pos,
+		size_t count) {
+	struct address_space *mapping = filePtr->f_mapping;
+	struct page *page;
+	char *pageAddr;
+	unsigned long offset;
+	unsigned long chunk;
+	unsigned long left;
+	size_t copied = 0;
+
+	if (sessionDataPtr->deferredError < 0) {
+		return sessionDataPtr->deferredError;
+	}
+
+	while (copied < count) {
+		page = read_mapping_page(mapping, (pos + copied) >> PAGE_CACHE_SHIFT,
+				filePtr);
+		if (IS_ERR(page)) {
+			return copied > 0 ? copied : PTR_ERR(page);
+		}
+
+		offset = (pos + copied) & (PAGE_CACHE_SIZE - 1);
+		chunk = min_t(unsigned long, count - copied, PAGE_CACHE_SIZE - offset);
+		pageAddr = kmap(page);
+		left = copy_to_user(&buff[copied], pageAddr + offset, chunk);
+		kunmap(page);
+		page_cache_release(page);
+
+		copied += chunk - left;
+		if (left != 0) {
+			return copied > 0 ? copied : -EFAULT;
+		}
+	}
+
+	return copied;
+}
+
+#ifdef SESSION_HAVE_ITER
+/*
+ * Same as _sessionReadDeferred, copying to an iterator
+ */
+static ssize_t _sessionReadDeferredIter(struct file *filePtr,
+		sessionData *sessionDataPtr, struct iov_iter *to, loff_t pos,
+		size_t count) {
+	struct address_space *mapping = filePtr->f_mapping;
+	struct page *page;
+	unsigned long offset;
+	unsigned long chunk;
+	size_t pageCopied;
+	size_t copied = 0;
+
+	if (sessionDataPtr->deferredError < 0) {
+		return sessionDataPtr->deferredError;
+	}
+
+	while (copied < count) {
+		page = read_mapping_page(mapping, (pos + copied) >> PAGE_CACHE_SHIFT,
+				filePtr);
+		if (IS_ERR(page)) {
+			return copied > 0 ? copied : PTR_ERR(page);
+		}
+
+		offset = (pos + copied) & (PAGE_CACHE_SIZE - 1);
+		chunk = min_t(unsigned long, count - copied, PAGE_CACHE_SIZE - offset);
+		pageCopied = copy_page_to_iter(page, offset, chunk, to);
+		page_cache_release(page);
+
+		copied += pageCopied;
+		if (pageCopied != chunk) {
+			return copied > 0 ? copied : -EFAULT;
+		}
+	}
+
+	return copied;
+}
+#endif
+
+/*
+ * Called by the hook on the opens, before a file opened for writing is returned, whatever syscall or kernel
+ * user opens it. The sessions deferring their copy-in on the file copy it in before it can be written. The
+ * files the sessions open to write themselves back are skipped, those copy in the sessions beforehand
+ * @filePtr: the file being opened
+ */
+void sessionWriterFile(struct file *filePtr) {
+	if ((filePtr->f_mode & FMODE_WRITE) && !(filePtr->f_flags & O_SESSION)) {
+		_sessionMaterializeInode(_fileInode(filePtr));
+	}
+}
+EXPORT_SYMBOL_GPL(sessionWriterFile);
+
+/*
+ * Called by the hook on the size changes, before the inode is truncated or extended, with the inode lock
+ * held. The sessions deferring their copy-in on the inode copy it in now
+ * @inode: the inode being resized
+ */
+void sessionWriterInode(struct inode *inode) {
+	_sessionMaterializeInode(inode);
+}
+EXPORT_SYMBOL_GPL(sessionWriterInode);
+
+/*
+ * Creates a new session based on the given file pointer, using a session slot already reserved by the caller
+ * and a session already charged to the accounts of the opener, which the session takes over on success.
+ * On failure the slot and the accounts are still charged, and must be given back by the caller.
+ * @filePtr: a pointer to a file struct
+ * @flags: open flags
+ * @mode: open mode, possibly carrying session hints
+ * @budgets: accounts of the opener, as returned by sessionBudgetAdmit
+ */
+static int _sessionOpenAdmitted(struct file *filePtr, int flags, int mode,
+		sessionBudget **budgets) {
+	unsigned long count;
+	ssize_t readenBytes;
+	sessionData * sessionDataPtr;
+	int node = NUMA_NO_NODE;
+	int truncate = (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY;
+#ifdef SESSION_HOOK_WRITERS
+	int defer = (mode & SESSION_HINT_DEFER) && !truncate
+			&& _mappingCanReadPages(filePtr->f_mapping);
+#else
+	// The writers inside the kernel are not seen, the file could change under a deferring session
+	int defer = 0;
+#endif
+	int writers;
+	int ret;
+	// The buffer order may change meanwhile, the session sticks to the one read here
+	int limitOrder = ACCESS_ONCE(maxBufferOrder);
+	int order = limitOrder;
+
+	// An explicit node hint overrides the placement policy
+	if (mode & SESSION_HINT_NODE_MASK) {
+		node = ((mode & SESSION_HINT_NODE_MASK) >> SESSION_HINT_NODE_SHIFT) - 1;
+		if (node >= nr_node_ids || !node_online(node)) {
+			printk(KERN_WARNING "Invalid session buffer node %d\n", node);
+			return -EINVAL;
+		}
+	}
+
+	// The write backs journaled so far are part of the file the session copies in
+	ret = sessionJournalSync(_fileInode(filePtr));
+	if (ret < 0) {
+		return ret;
+	}
+
+	// Retrieve the file size, and check it against the maximum manageable file size. The truncation requested
+	// by O_TRUNC has been deferred to the commit, the session starts empty
+	count = truncate ? 0 : i_size_read(_fileInode(filePtr));
+	if (count > (PAGE_SIZE << limitOrder)) {
+		printk(KERN_WARNING "File too large\n");
+		return -EFBIG;
+	}
+
+	// A read only session only needs to hold the file, an expected size overrides the default buffer size
+	if (mode & SESSION_HINT_RDONLY) {
+		order = _sessionOrderFor(count);
+	} else if (mode & SESSION_HINT_SIZE_MASK) {
+		order = ((mode & SESSION_HINT_SIZE_MASK) >> SESSION_HINT_SIZE_SHIFT) - 1;
+		order = min(max(order, _sessionOrderFor(count)), limitOrder);
+	}
+
+	// Allocate a pointer to a sessionData
+	sessionDataPtr = (sessionData*) kmalloc(sizeof(sessionData),
+	KAMLLOCFLAGS);
+	if (sessionDataPtr == NULL ) {
+		printk(KERN_WARNING "Can't allocate pointer_struct\n");
+		return -ENOMEM;
+	}
+
+	// The session buffer is charged to the accounts before being allocated
+	memcpy(sessionDataPtr->budgets, budgets, sizeof(sessionDataPtr->budgets));
+	ret = sessionBudgetCharge(sessionDataPtr->budgets, PAGE_SIZE << order);
+	if (ret < 0) {
+		kfree(sessionDataPtr);
+		return ret;
+	}
+	sessionDataPtr->chargedBytes = PAGE_SIZE << order;
+
+	// Allocate the session buffer, on the node of the opener unless a node has been requested
+	sessionDataPtr->bufferOrder = order;
+	sessionDataPtr->maxOrder = (mode & SESSION_HINT_RDONLY) ? order : limitOrder;
+	sessionDataPtr->readOnly = (mode & SESSION_HINT_RDONLY) != 0;
+	sessionDataPtr->noCache = (mode & SESSION_HINT_NOCACHE) != 0;
+	sessionDataPtr->buffer = sessionBufferAlloc(node,
+			sessionDataPtr->bufferOrder);
+	if (sessionDataPtr->buffer == NULL ) {
+		printk(KERN_WARNING "Can't allocate session buffer\n");
+		sessionBudgetUncharge(sessionDataPtr->budgets,
+				sessionDataPtr->chargedBytes);
+		kfree(sessionDataPtr);
+		return -ENOMEM;
+	}
+	sessionDataPtr->fileInBufferSize = 0;
+	sessionDataPtr->migrateOnAccess = (node == NUMA_NO_NODE
+			&& bufferNodePolicy == SESSION_NODE_FIRSTACCESS);
+
+	if ((mode & SESSION_HINT_SEQUENTIAL) && count > 0) {
+		sessionPrefetch(filePtr);
+	}
+
+	// Read the file and store it in the session buffer
+	down_read(&groupCommitLock);
+	_sessionRecordBase(filePtr, sessionDataPtr);
+	if (defer) {
+		// Nothing is copied in until the file is about to be written
+		sessionDataPtr->deferred = 1;
+		sessionDataPtr->loadedBlocks = ~0UL;
+		readenBytes = count;
+	} else {
+		readenBytes = _sessionPopulate(filePtr, sessionDataPtr, count,
+				!truncate && (flags & O_ACCMODE) == O_WRONLY);
+		if (readenBytes >= 0) {
+			_sessionRecordChecksum(sessionDataPtr, readenBytes);
+		}
+	}
+	up_read(&groupCommitLock);
+	if (readenBytes < 0) {
+		printk(KERN_WARNING "Kernel read failed\n");
+		sessionBufferFree(sessionDataPtr->buffer, sessionDataPtr->bufferOrder);
+		sessionBudgetUncharge(sessionDataPtr->budgets,
+				sessionDataPtr->chargedBytes);
+		kfree(sessionDataPtr);
+		return readenBytes;
+	}
+	sessionDataPtr->fileInBufferSize = readenBytes;
+
+	// Set the flag to avoid concurrent session FOPS
+	atomic_set(&sessionDataPtr->usageCountAndFlag,BADSTATEFLAG);
+
+	// Initialize both locks
+	init_rwsem(&sessionDataPtr->fileInBufferLock);
+	mutex_init(&sessionDataPtr->writeLock);
+
+	// Save the original private_data pointer and file operations struct pointers in the sessionData
+	sessionDataPtr->private_data = filePtr->private_data;
+	sessionDataPtr->filePtr = filePtr;
+	sessionDataPtr->oldFops = filePtr->f_op;
+
+	INIT_LIST_HEAD(&sessionDataPtr->deferredList);
+	if (defer) {
+		mutex_lock(&deferredLock);
+		list_add(&sessionDataPtr->deferredList,
+				&deferredSessions[hash_ptr(_fileInode(filePtr), DEFERRED_BITS)]);
+		atomic_inc(&deferredCount);
+		mutex_unlock(&deferredLock);
+
+		// Pairs with the writers opening the file, which take write access and then look for us. Writers
+		// that opened it before us, other than the session itself, make the deferral pointless
+		smp_mb();
+		writers = atomic_read(&_fileInode(filePtr)->i_writecount)
+				- ((filePtr->f_mode & FMODE_WRITE) ? 1 : 0);
+		if (writers > 0) {
+			// They may have written since the base was taken, nothing has been read yet: copy in the file
+			// as it is now
+			ret = _sessionRefresh(filePtr, sessionDataPtr);
+			if (ret < 0) {
+				sessionBufferFree(sessionDataPtr->buffer,
+						sessionDataPtr->bufferOrder);
+				sessionBudgetUncharge(sessionDataPtr->budgets,
+						sessionDataPtr->chargedBytes);
+				kfree(sessionDataPtr);
+				return ret;
+			}
+		}
+	}
+
+	// Atomically switch file operations
+	xchg(&filePtr->f_op, &session_fops);
+
+	// Switch session and private data
+	filePtr->private_data = (void*) sessionDataPtr;
+
+#ifdef SESSION_HAVE_ITER
+	// Reads and writes never block on I/O, io_uring can issue them inline
+	filePtr->f_mode |= FMODE_NOWAIT;
+#endif
+
+	// The replay of a trace needs the size of the file and how it has been opened
+	sessionDataPtr->traceId = sessionTraceEnabled ? sessionTraceNewId() : 0;
+	_trace(SESSION_TRACE_OPEN, sessionDataPtr, count, flags, mode);
+
+	// Unlock session FOPS
+	atomic_set(&sessionDataPtr->usageCountAndFlag,0);
+
+	printk(KERN_ERR "Open Switch Done\n");
+
+	// Locks the module until the session exists
+	try_module_get(THIS_MODULE );
+
+	return 0;
+}
+
+/*
+ * Creates a new session based on the given file pointer, using a session slot already reserved by the caller.
+ * The session is charged to the accounts of the opener without waiting, and fails with -EDQUOT if one of them
+ * is over its budget. On failure the slot is still reserved, and must be given back by the caller.
+ * @filePtr: a pointer to a file struct
+ * @flags: open flags
+ * @mode: open mode, possibly carrying session hints
+ */
+int sessionOpenReserved(struct file *filePtr, int flags, int mode) {
+	sessionBudget *budgets[SESSION_BUDGETS];
+	int ret;
+
+	ret = sessionBudgetAdmit(budgets, 0, 0);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = _sessionOpenAdmitted(filePtr, flags, mode, budgets);
+	if (ret < 0) {
+		sessionBudgetRelease(budgets);
+	}
+	return ret;
+}
+
+/*
+ * IF the flags contain the O_SESSION bit, creates a new session based on the given file pointer.
+ * @filePtr: a pointer to a file struct
+ * @flags: open flags
+ * @mode: open mode, possibly carrying session hints
+ */
+int sessionOpen(struct file *filePtr, int flags, int mode) {
+	sessionBudget *budgets[SESSION_BUDGETS];
+	int wait = blockingAdmission || (mode & SESSION_HINT_WAIT);
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	unsigned long deadline;
+	int ret;
+
+	if (flags & O_SESSION) {
+		// The waits for the accounts and for a slot share one deadline
+		if (admissionTimeoutMs > 0) {
+			timeout = msecs_to_jiffies(admissionTimeoutMs);
+		}
+		deadline = jiffies + timeout;
+
+		// The accounts of the opener come first, so that an opener over its budget never holds a session slot
+		// that the other users are waiting for
+		ret = sessionBudgetAdmit(budgets, wait, timeout);
+		if (ret < 0) {
+			return ret;
+		}
+
+		if (timeout != MAX_SCHEDULE_TIMEOUT) {
+			timeout = time_before(jiffies, deadline) ? (long) (deadline - jiffies) : 0;
+		}
+
+		// If the O_SESSION flag is present, check if a new session can be created and go ahead
+		ret = _sessionAdmit(wait, timeout);
+		if (ret < 0) {
+			sessionBudgetRelease(budgets);
+			return ret;
+		}
+
+		ret = _sessionOpenAdmitted(filePtr, flags, mode, budgets);
+		if (ret < 0) {
+			sessionUnreserve(1);
+			sessionBudgetRelease(budgets);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(sessionOpen);
+
+/*
+ * Returns the flags the real open behind a session open must be called with. The truncation of a writable
+ * file is deferred to the commit, the session simply starts empty
+ * @flags: open flags
+ */
+int sessionRealOpenFlags(int flags) {
+	if ((flags & O_SESSION) && (flags & O_ACCMODE) != O_RDONLY) {
+		return flags & ~O_TRUNC;
+	}
+	return flags;
+}
+
+/*
+ * Session Read File Operation
+ * Runs concurrently against other reads and writes, except when reading the current  size of the stored file
+ */
+ssize_t sessionRead(struct file * filePtr, char __user * buff, size_t count,
+loff_t * pos) {
+	ssize_t ret;
+	char *addr;
+
+	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
+	if(_statIncUnlessSet(&getSessionData(filePtr)->usageCountAndFlag) < 0 ){
+		printk(KERN_ERR "Session Data in Bad State\n");
+		return -EBADFD;
+	}
+
+	_trace(SESSION_TRACE_READ, getSessionData(filePtr), *pos, count, 0);
+
+	if (unlikely(getSessionData(filePtr)->migrateOnAccess)) {
+		_sessionMigrateBuffer(getSessionData(filePtr));
+	}
+
+	// Check if the given pos is inside the file in buffer size, taking the lock
+	// protecting the field in read mode
+	_statDownRead(&getSessionData(filePtr) ->fileInBufferLock);
+	if (*pos > getSessionData(filePtr) ->fileInBufferSize) {
+		up_read(&getSessionData(filePtr) ->fileInBufferLock);
+		printk(KERN_WARNING "Requested read overflows session buffer\n");
+		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+		return -EOVERFLOW;
+	}
+
+	// Limit the read to the file in buffer size
+	if ((*pos + count) > getSessionData(filePtr) ->fileInBufferSize) {
+		count = getSessionData(filePtr) ->fileInBufferSize - *pos;
+	}
+
+	// Until the copy-in the file itself holds the session contents
+	if (unlikely(getSessionData(filePtr)->deferred)) {
+		ret = _sessionReadDeferred(filePtr, getSessionData(filePtr), buff, *pos,
+				count);
+		up_read(&getSessionData(filePtr) ->fileInBufferLock);
+		if (ret > 0) {
+			*pos = *pos + ret;
+		}
+		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+		return ret;
+	}
+	up_read(&getSessionData(filePtr) ->fileInBufferLock);
+
+	addr = ACCESS_ONCE(getSessionData(filePtr) ->buffer);
+
+	// Performs the write (copy) of buff on the session buffer
+	ret = copy_to_user(buff, &addr[*pos], count); //ret = number of non copied bytes
+	*pos = *pos + count - ret;
+
+	// Decrements the usage count
+	atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+	return count - ret;
+}
+EXPORT_SYMBOL_GPL(sessionRead);
+
+/*
+ * Session Write File Operation
+ * Runs concurrently against reads, but exclusively against other writes taking the write lock
+ */
+ssize_t sessionWrite(struct file * filePtr, const char __user * buff,
+size_t count, loff_t * pos) {
+	ssize_t ret;
+	char *addr;
+	unsigned long maxSize = PAGE_SIZE << getSessionData(filePtr)->maxOrder;
+	unsigned long skipped;
+
+	if (getSessionData(filePtr)->readOnly) {
+		return -EBADF;
+	}
+
+	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
+	if(_statIncUnlessSet(&getSessionData(filePtr)->usageCountAndFlag) < 0 ){
+		printk(KERN_ERR "Session Data in Bad State\n");
+		return -EBADFD;
+	}
+
+	_trace(SESSION_TRACE_WRITE, getSessionData(filePtr), *pos, count, 0);
+
+	if (unlikely(getSessionData(filePtr)->migrateOnAccess)) {
+		_sessionMigrateBuffer(getSessionData(filePtr));
+	}
+
+	// Check if the given pos is inside the buffer
+	if (*pos >= maxSize) {
+		printk(KERN_WARNING "Requested write overflows session buffer\n");
+		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+		return -EOVERFLOW;
+	}
+
+	// Limit the read to the buffer size
+	if ((count + *pos) > maxSize) {
+		count = maxSize - *pos;
+	}
+
+	if (count == 0) {
+		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+		return 0;
+	}
+
+	// The first write copies in the file contents, if it has been deferred
+	if (unlikely(getSessionData(filePtr)->deferred)) {
+		ret = _sessionMaterialize(getSessionData(filePtr));
+		if (ret < 0) {
+			atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+			return ret;
+		}
+	}
+
+	_statMutexLock(&getSessionData(filePtr) ->writeLock);
+
+	// Grows the buffer and copies in the file contents the write does not cover
+	ret = _sessionEnsureCapacity(getSessionData(filePtr), *pos + count);
+	if (ret == 0) {
+		ret = _sessionPrepareWrite(filePtr, getSessionData(filePtr), *pos, count,
+				&skipped);
+	}
+	if (ret < 0) {
+		mutex_unlock(&getSessionData(filePtr) ->writeLock);
+		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+		return ret;
+	}
+
+	addr = getSessionData(filePtr) ->buffer;
+
+	// Performs the "read" (copy) from the session buffer to buff
+	ret = copy_from_user(&addr[*pos], buff, count); //ret = number of non copied bytes
+	if (unlikely(skipped != 0 && ret != 0)) {
+		_sessionFinishWrite(filePtr, getSessionData(filePtr), *pos + count - ret,
+				skipped);
+	}
+
+	// Check if we must update the size of the stored file
+	if (getSessionData(filePtr) ->fileInBufferSize < (*pos + (count - ret))) {
+		// Since write are not executed concurrently , we only need to avoid some read to check the size of the
+		// stored file when we are updating it
+		_statDownWrite(&getSessionData(filePtr) ->fileInBufferLock);
+		getSessionData(filePtr) ->fileInBufferSize = *pos + (count - ret);
+		up_write(&getSessionData(filePtr) ->fileInBufferLock);
+	}
+
+	mutex_unlock(&getSessionData(filePtr) ->writeLock);
+
+	*pos = *pos + count - ret;
+	// Decrements the usage count
+	atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+	return count - ret;
+}
+EXPORT_SYMBOL_GPL(sessionWrite);
+
+#ifdef SESSION_HAVE_ITER
+/*
+ * Session read_iter File Operation, serving read, readv, preadv2, AIO and io_uring on current kernels
+ * Same semantics of sessionRead. The data is in memory, so the only wait is on the lock protecting the size
+ * of the stored file: with IOCB_NOWAIT it is only tried, hence non blocking submissions never sleep
+ */
+ssize_t sessionReadIter(struct kiocb *iocb, struct iov_iter *to) {
+	sessionData *sessionDataPtr = getSessionData(iocb->ki_filp);
+	size_t count = iov_iter_count(to);
+	size_t copied;
+	ssize_t ret;
+	char *addr;
+
+	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
+	if(_statIncUnlessSet(&sessionDataPtr->usageCountAndFlag) < 0 ){
+		printk(KERN_ERR "Session Data in Bad State\n");
+		return -EBADFD;
+	}
+
+	_trace(SESSION_TRACE_READ, sessionDataPtr, iocb->ki_pos, count, 0);
+
+	// The migration allocates and sleeps, a non blocking read leaves it to the next access
+	if (unlikely(sessionDataPtr->migrateOnAccess)
+			&& !(iocb->ki_flags & IOCB_NOWAIT)) {
+		_sessionMigrateBuffer(sessionDataPtr);
+	}
+
+	// Check if the given pos is inside the file in buffer size, taking the lock
+	// protecting the field in read mode
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!down_read_trylock(&sessionDataPtr->fileInBufferLock)) {
+			atomic_dec(&sessionDataPtr->usageCountAndFlag);
+			return -EAGAIN;
+		}
+	} else {
+		_statDownRead(&sessionDataPtr->fileInBufferLock);
+	}
+	if (iocb->ki_pos > sessionDataPtr->fileInBufferSize) {
+		up_read(&sessionDataPtr->fileInBufferLock);
+		printk(KERN_WARNING "Requested read overflows session buffer\n");
+		atomic_dec(&sessionDataPtr->usageCountAndFlag);
+		return -EOVERFLOW;
+	}
+
+	// Limit the read to the file in buffer size
+	if ((iocb->ki_pos + count) > sessionDataPtr->fileInBufferSize) {
+		count = sessionDataPtr->fileInBufferSize - iocb->ki_pos;
+	}
+
+	// Until the copy-in the file itself holds the session contents, reading it may wait for the disk
+	if (unlikely(sessionDataPtr->deferred)) {
+		if (iocb->ki_flags & IOCB_NOWAIT) {
+			ret = -EAGAIN;
+		} else {
+			ret = _sessionReadDeferredIter(iocb->ki_filp, sessionDataPtr, to,
+					iocb->ki_pos, count);
+		}
+		up_read(&sessionDataPtr->fileInBufferLock);
+		if (ret > 0) {
+			iocb->ki_pos += ret;
+		}
+		atomic_dec(&sessionDataPtr->usageCountAndFlag);
+		return ret;
+	}
+	up_read(&sessionDataPtr->fileInBufferLock);
+
+	addr = ACCESS_ONCE(sessionDataPtr->buffer);
+
+	// Copies the session buffer to the iterator segments
+	copied = copy_to_iter(&addr[iocb->ki_pos], count, to);
+	iocb->ki_pos += copied;
+
+	// Decrements the usage count
+	atomic_dec(&sessionDataPtr->usageCountAndFlag);
+
+	if (copied == 0 && count > 0) {
+		return -EFAULT;
+	}
+	return copied;
+}
+EXPORT_SYMBOL_GPL(sessionReadIter);
+
+/*
+ * Session write_iter File Operation, serving write, writev, pwritev2, AIO and io_uring on current kernels
+ * Same semantics of sessionWrite, with O_APPEND honoured. With IOCB_NOWAIT the write lock is only tried
+ */
+ssize_t sessionWriteIter(struct kiocb *iocb, struct iov_iter *from) {
+	sessionData *sessionDataPtr = getSessionData(iocb->ki_filp);
+	size_t count = iov_iter_count(from);
+	size_t copied;
+	loff_t pos;
+	unsigned long maxSize = PAGE_SIZE << sessionDataPtr->maxOrder;
+	unsigned long skipped;
+	int ret;
+
+	if (sessionDataPtr->readOnly) {
+		return -EBADF;
+	}
+
+	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
+	if(_statIncUnlessSet(&sessionDataPtr->usageCountAndFlag) < 0 ){
+		printk(KERN_ERR "Session Data in Bad State\n");
+		return -EBADFD;
+	}
+
+	_trace(SESSION_TRACE_WRITE, sessionDataPtr, iocb->ki_pos, count, 0);
+
+	if (unlikely(sessionDataPtr->migrateOnAccess)
+			&& !(iocb->ki_flags & IOCB_NOWAIT)) {
+		_sessionMigrateBuffer(sessionDataPtr);
+	}
+
+	// The first write copies in the file contents, if it has been deferred
+	if (unlikely(sessionDataPtr->deferred)) {
+		ret = (iocb->ki_flags & IOCB_NOWAIT) ?
+				-EAGAIN : _sessionMaterialize(sessionDataPtr);
+		if (ret < 0) {
+			atomic_dec(&sessionDataPtr->usageCountAndFlag);
+			return ret;
+		}
+	}
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(&sessionDataPtr->writeLock)) {
+			atomic_dec(&sessionDataPtr->usageCountAndFlag);
+			return -EAGAIN;
+		}
+	} else {
+		_statMutexLock(&sessionDataPtr->writeLock);
+	}
+
+	// Appends go at the end of the session file, which can't change while we hold the write lock
+	pos = iocb->ki_pos;
+	if (iocb->ki_flags & IOCB_APPEND) {
+		pos = sessionDataPtr->fileInBufferSize;
+	}
+
+	// Check if the given pos is inside the buffer
+	if (pos >= maxSize) {
+		mutex_unlock(&sessionDataPtr->writeLock);
+		printk(KERN_WARNING "Requested write overflows session buffer\n");
+		atomic_dec(&sessionDataPtr->usageCountAndFlag);
+		return -EOVERFLOW;
+	}
+
+	// Limit the write to the buffer size
+	if ((count + pos) > maxSize) {
+		count = maxSize - pos;
+	}
+
+	if (count == 0) {
+		mutex_unlock(&sessionDataPtr->writeLock);
+		atomic_dec(&sessionDataPtr->usageCountAndFlag);
+		return 0;
+	}
+
+	// Growing the buffer or copying in file contents may sleep, non blocking submissions are retried
+	if ((iocb->ki_flags & IOCB_NOWAIT)
+			&& (pos + count > (PAGE_SIZE << sessionDataPtr->bufferOrder)
+					|| sessionDataPtr->loadedBlocks != ~0UL)) {
+		mutex_unlock(&sessionDataPtr->writeLock);
+		atomic_dec(&sessionDataPtr->usageCountAndFlag);
+		return -EAGAIN;
+	}
+
+	// Grows the buffer and copies in the file contents the write does not cover
+	ret = _sessionEnsureCapacity(sessionDataPtr, pos + count);
+	if (ret == 0) {
+		ret = _sessionPrepareWrite(iocb->ki_filp, sessionDataPtr, pos, count,
+				&skipped);
+	}
+	if (ret < 0) {
+		mutex_unlock(&sessionDataPtr->writeLock);
+		atomic_dec(&sessionDataPtr->usageCountAndFlag);
+		return ret;
+	}
+
+	// Copies the iterator segments to the session buffer
+	copied = copy_from_iter(&sessionDataPtr->buffer[pos], count, from);
+	if (unlikely(skipped != 0 && copied != count)) {
+		_sessionFinishWrite(iocb->ki_filp, sessionDataPtr, pos + copied, skipped);
+	}
+
+	// Check if we must update the size of the stored file
+	if (sessionDataPtr->fileInBufferSize < (pos + copied)) {
+		_statDownWrite(&sessionDataPtr->fileInBufferLock);
+		sessionDataPtr->fileInBufferSize = pos + copied;
+		up_write(&sessionDataPtr->fileInBufferLock);
+	}
+
+	mutex_unlock(&sessionDataPtr->writeLock);
+
+	iocb->ki_pos = pos + copied;
+	// Decrements the usage count
+	atomic_dec(&sessionDataPtr->usageCountAndFlag);
+
+	if (copied == 0 && count > 0) {
+		return -EFAULT;
+	}
+	return copied;
+}
+EXPORT_SYMBOL_GPL(sessionWriteIter);
+#endif
+
+/*
+ * Session llseek File Operation
+ * Mimicks the generic_file_llseek, returning errors on non supported operations and avoiding that pos overflows the
+ * maximum buffer size
+ */
+
+loff_t sessionLlseek(struct file *filePtr, loff_t offset, int origin) {
+	int ret;
+	loff_t maxsize = PAGE_SIZE << getSessionData(filePtr)->maxOrder;
+
+	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
+	if(_statIncUnlessSet(&getSessionData(filePtr)->usageCountAndFlag) < 0 ){
+		printk(KERN_ERR "Session Data in Bad State\n");
+		return -EBADFD;
+	}
+
+	_trace(SESSION_TRACE_LLSEEK, getSessionData(filePtr), offset, origin, 0);
+
+	switch (origin) {
+	case SEEK_END:
+		offset += getSessionData(filePtr) ->fileInBufferSize;
+		break;
+
+	case SEEK_CUR:
+		if (offset == 0){
+			// Decrements the usage count
+			atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+			return filePtr->f_pos;
+		}
+
+		spin_lock(&filePtr->f_lock);
+		offset = _lseekExecute(filePtr, filePtr->f_pos + offset, maxsize);
+		spin_unlock(&filePtr->f_lock);
+
+		// Decrements the usage count
+		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+		return offset;
+		break;
+	case SEEK_DATA:
+		// Decrements the usage count
+		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+		return -ENOTSUPP;
+		break;
+	case SEEK_HOLE:
+		// Decrements the usage count
+		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+		return -ENOTSUPP;
+		break;
+	}
+	ret = _lseekExecute(filePtr, offset, maxsize);
+	// Decrements the usage count
+	atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(sessionLlseek);
+
+
+/*
+ * Turns on or off the accounting of the time spent on the session locks, resetting the counters
+ */
+void sessionLockStatEnable(int enable) {
+	int cpu;
+
+	lockStatEnabled = 0;
+	for_each_possible_cpu(cpu) {
+		memset(&per_cpu(sessionLockStats, cpu), 0, sizeof(struct sessionLockStat));
+	}
+	lockStatEnabled = enable;
+}
+EXPORT_SYMBOL_GPL(sessionLockStatEnable);
+
+/*
+ * Copies the lock accounting of a CPU
+ */
+void sessionLockStatRead(int cpu, struct sessionLockStat *stat) {
+	*stat = per_cpu(sessionLockStats, cpu);
+}
+EXPORT_SYMBOL_GPL(sessionLockStatRead);
+
+/*
+ * Returns true if the file is currently accessed with session semantics
+ */
+int sessionIsSession(struct file *filePtr) {
+	return filePtr->f_op == &session_fops;
+}
+
+/*
+ * Discards a session: nothing is written back when it is closed
+ */
+void sessionAbort(struct file *filePtr) {
+	getSessionData(filePtr)->aborted = 1;
+}
+
+/*
+ * Zeroes length bytes of the session buffer starting from start, as a write of zeros would. Called with
+ * the write lock held
+ */
+static int _sessionZeroRange(struct file *filePtr, sessionData *sessionDataPtr,
+		unsigned long start, unsigned long length) {
+	unsigned long skipped;
+	int ret;
+
+	if (length == 0) {
+		return 0;
+	}
+
+	ret = _sessionPrepareWrite(filePtr, sessionDataPtr, start, length, &skipped);
+	if (ret < 0) {
+		return ret;
+	}
+	memset(&sessionDataPtr->buffer[start], 0, length);
+
+	return 0;
+}
+
+/*
+ * Sets the size of the session file, growing the buffer if needed and zeroing the dropped bytes so that
+ * they read back as zeros if the file grows again. Called with the write lock held
+ */
+static int _sessionSetSize(struct file *filePtr, sessionData *sessionDataPtr,
+		unsigned long size) {
+	int ret;
+
+	if (size < sessionDataPtr->fileInBufferSize) {
+		ret = _sessionZeroRange(filePtr, sessionDataPtr, size,
+				sessionDataPtr->fileInBufferSize - size);
+		if (ret < 0) {
+			return ret;
+		}
+		// The dropped file contents must not be copied in anymore
+		sessionDataPtr->loadableSize = min(sessionDataPtr->loadableSize, size);
+	} else {
+		ret = _sessionEnsureCapacity(sessionDataPtr, size);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	down_write(&sessionDataPtr->fileInBufferLock);
+	sessionDataPtr->fileInBufferSize = size;
+	up_write(&sessionDataPtr->fileInBufferLock);
+
+	return 0;
+}
+
+/*
+ * Session Truncate, reached through ftruncate on a session file descriptor.
+ * Changes the size of the session file only, the file is truncated on commit
+ * @filePtr: a pointer to a file struct
+ * @length: the new size
+ */
+long sessionTruncate(struct file *filePtr, loff_t length) {
+	sessionData* sessionDataPtr = getSessionData(filePtr);
+	int ret;
+
+	if (!(filePtr->f_mode & FMODE_WRITE ) || sessionDataPtr->readOnly) {
+		return -EINVAL;
+	}
+
+	if (length < 0) {
+		return -EINVAL;
+	}
+
+	if (length > (PAGE_SIZE << sessionDataPtr->maxOrder)) {
+		return -EFBIG;
+	}
+
+	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
+	if(_atomicIncUnlessSet(&sessionDataPtr->usageCountAndFlag,BADSTATEFLAG) < 0 ){
+		printk(KERN_ERR "Session Data in Bad State\n");
+		return -EBADFD;
+	}
 
-// New Session File Operations Struct
-const struct file_operations session_fops = { owner : THIS_MODULE, read:sessionRead, write
-		: sessionWrite, llseek: sessionLlseek, flush: sessionFlush, };
+	ret = sessionDataPtr->deferred ? _sessionMaterialize(sessionDataPtr) : 0;
+	if (ret == 0) {
+		mutex_lock(&sessionDataPtr->writeLock);
+		ret = _sessionSetSize(filePtr, sessionDataPtr, length);
+		mutex_unlock(&sessionDataPtr->writeLock);
+	}
 
-extern int kernel_read(struct file * filePtr, loff_t offset, char* addr,
-unsigned long count);
+	// Decrements the usage count
+	atomic_dec(&sessionDataPtr->usageCountAndFlag);
+	return ret;
+}
 
 /*
- * if maxSession is less than 0, then the maximum number of sessions is set to default, if it exceeds the cap of sessions
- * it is set to the cap value, otherwise maxSession is the maximum number of session
- * Similarly for maxBufferOrder
- * @maxSession: requested maximum number of sessions
- * @bufferOrder: requested session buffer order
+ * Session fallocate File Operation
+ * Preallocation grows the session buffer to the requested range, and grows the session file unless
+ * FALLOC_FL_KEEP_SIZE is given. Punching a hole zeroes the range in the session buffer
  */
-int sessionInit(int maxSession, int bufferOrder) {
-	int pages;
-	if (maxSession > 0) {
-		if (maxSession > MAX_SESSIONNUM) {
-			maxSessionNum = MAX_SESSIONNUM;
-		} else {
-			maxSessionNum = maxSession;
+long sessionFallocate(struct file *filePtr, int mode, loff_t offset, loff_t len) {
+	sessionData* sessionDataPtr = getSessionData(filePtr);
+	loff_t end = offset + len;
+	int ret = 0;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+		return -EOPNOTSUPP;
+	}
+
+	if (sessionDataPtr->readOnly) {
+		return -EBADF;
+	}
+
+	if (end > (PAGE_SIZE << sessionDataPtr->maxOrder)) {
+		return -EFBIG;
+	}
+
+	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
+	if(_atomicIncUnlessSet(&sessionDataPtr->usageCountAndFlag,BADSTATEFLAG) < 0 ){
+		printk(KERN_ERR "Session Data in Bad State\n");
+		return -EBADFD;
+	}
+
+	if (sessionDataPtr->deferred) {
+		ret = _sessionMaterialize(sessionDataPtr);
+		if (ret < 0) {
+			atomic_dec(&sessionDataPtr->usageCountAndFlag);
+			return ret;
 		}
 	}
 
-	if (bufferOrder >= 0) {
-		pages = 1 << bufferOrder;
-		maxBufferOrder = bufferOrder;
-		if (pages > MAX_PAGENUM) {
-			pages = MAX_PAGENUM;
-			maxBufferOrder = MAX_BUFFERORDER;
+	mutex_lock(&sessionDataPtr->writeLock);
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		// Only the part of the hole inside the session file must be zeroed, the rest is already zero
+		if (offset < sessionDataPtr->fileInBufferSize) {
+			if (end > sessionDataPtr->fileInBufferSize) {
+				end = sessionDataPtr->fileInBufferSize;
+			}
+			ret = _sessionZeroRange(filePtr, sessionDataPtr, offset, end - offset);
 		}
-		maxBufferSize = 4096 * pages;
+	} else if (!(mode & FALLOC_FL_KEEP_SIZE)
+			&& end > sessionDataPtr->fileInBufferSize) {
+		ret = _sessionSetSize(filePtr, sessionDataPtr, end);
+	} else {
+		ret = _sessionEnsureCapacity(sessionDataPtr, end);
 	}
-	return 0;
+
+	mutex_unlock(&sessionDataPtr->writeLock);
+
+	// Decrements the usage count
+	atomic_dec(&sessionDataPtr->usageCountAndFlag);
+	return ret;
 }
 
 /*
- * IF the flags contain the O_SESSION bit, creates a new session based on the given file pointer.
- * @filePtr: a pointer to a file struct
- * @flags: open flags
+ * Returns true if the session has something to write back: it could write, has not been aborted and
+ * has copied in the file, a session still deferring the copy-in holds nothing but the file
  */
-int sessionOpen(struct file *filePtr, int flags) {
-	unsigned long count;
-	unsigned long offset;
-	unsigned long readenBytes;
-	sessionData * sessionDataPtr;
-
-	if (flags & O_SESSION) {
-		// If the O_SESSION flag is present, check if a new session can be created and go ahead
-		if (_atomicIncUnless(&sessionCount, maxSessionNum)
-				>= maxSessionNum) {
-			printk(KERN_WARNING "Too many session opened\n");
-			return -EMFILE;
-		}
+static inline int _sessionCanCommit(struct file *filePtr,
+		sessionData *sessionDataPtr) {
+	return (filePtr->f_mode & FMODE_WRITE) && !sessionDataPtr->readOnly
+			&& !sessionDataPtr->aborted && !sessionDataPtr->deferred;
+}
 
-		// Retrieve the file size, and check it against the maximum manageable file size
-		count = filePtr->f_dentry->d_inode->i_size;
-		if (count > maxBufferSize) {
-			printk(KERN_WARNING "File too large\n");
-			atomic_dec(&sessionCount);
-			return -EFBIG;
-		}
+/*
+ * Writes back the session buffer to the file while the session goes on. The write lock keeps the buffer
+ * still, and the block hashes are taken again so that the next commit writes only the following changes.
+ * A checked session whose file changed since its base writes nothing and fails with -ESTALE, otherwise the
+ * file as written becomes its new base. An aborted session stays aborted and fails with -ECANCELED
+ */
+static int _sessionCommitInPlace(struct file *filePtr,
+		sessionData *sessionDataPtr) {
+	struct mutex *commitLock = _commitLockFor(_fileInode(filePtr));
+	struct file *commitFilePtr;
+	int ret;
 
-		// Allocate a pointer to a sessionData
-		sessionDataPtr = (sessionData*) kmalloc(sizeof(sessionData),
-		KAMLLOCFLAGS);
-		if (sessionDataPtr == NULL ) {
-			printk(KERN_WARNING "Can't allocate pointer_struct\n");
-			atomic_dec(&sessionCount);
-			return -ENOMEM;
-		}
+	if (!(filePtr->f_mode & FMODE_WRITE ) || sessionDataPtr->readOnly) {
+		return -EBADF;
+	}
 
-		// Allocate the session buffer
-		sessionDataPtr->buffer = (char*) __get_free_pages(KAMLLOCFLAGS,
-		maxBufferOrder);
-		if (sessionDataPtr->buffer == NULL ) {
-			printk(KERN_WARNING "Can't allocate session buffer\n");
-			kfree(sessionDataPtr);
-			atomic_dec(&sessionCount);
-			return -ENOMEM;
-		}
-		sessionDataPtr->fileInBufferSize = 0;
+	if (sessionDataPtr->aborted) {
+		return -ECANCELED;
+	}
 
-		// Read the file and store it in the session buffer
-		memset(sessionDataPtr->buffer, 0, maxBufferSize);
-		readenBytes = 0;
-		offset = 0;
-		do {
-			readenBytes = kernel_read(filePtr, offset,
-			&sessionDataPtr->buffer[offset], count);
-			if (readenBytes < 0) {
-				printk(KERN_WARNING "Kernel read failed\n");
-				kfree(sessionDataPtr->buffer);
-				kfree(sessionDataPtr);
-				atomic_dec(&sessionCount);
-				return readenBytes;
-			}
-			sessionDataPtr->fileInBufferSize += readenBytes;
-			count = count - readenBytes;
-			offset += readenBytes;
-		} while (count > 0);
+	// A session still deferring the copy-in holds what the file holds
+	if (sessionDataPtr->deferred) {
+		return 0;
+	}
 
-		// Set the flag to avoid concurrent session FOPS
-		atomic_set(&sessionDataPtr->usageCountAndFlag,BADSTATEFLAG);
+	// The session file would write in the session buffer again
+	commitFilePtr = _openFileForWrite(filePtr);
+	if (IS_ERR(commitFilePtr)) {
+		return PTR_ERR(commitFilePtr);
+	}
 
-		// Initialize both locks
-		init_rwsem(&sessionDataPtr->fileInBufferLock);
-		mutex_init(&sessionDataPtr->writeLock);
+	_sessionMaterializeInode(_fileInode(filePtr));
+	down_read(&groupCommitLock);
+	mutex_lock(commitLock);
+	// The journaled write backs of the file must be in it before comparing against it, or writing over it
+	ret = sessionJournalSync(_fileInode(filePtr));
+	if (ret < 0) {
+		goto unlock;
+	}
+	mutex_lock(&sessionDataPtr->writeLock);
+	if (sessionDataPtr->checked
+			&& _sessionBaseChanged(filePtr, sessionDataPtr)) {
+		ret = -ESTALE;
+	} else if (sessionJournalEnabled) {
+		ret = _commitSessionBufferJournaled(commitFilePtr, sessionDataPtr);
+	} else {
+		ret = _commitSessionBuffer(commitFilePtr, sessionDataPtr, NULL);
+	}
+	if (ret == 0) {
+		_sessionHashBlocks(sessionDataPtr, sessionDataPtr->fileInBufferSize);
+		_sessionRebase(filePtr, sessionDataPtr);
+	}
+	mutex_unlock(&sessionDataPtr->writeLock);
+unlock:
+	mutex_unlock(commitLock);
+	up_read(&groupCommitLock);
 
-		// Save the original private_data pointer and file operations struct pointers in the sessionData
-		sessionDataPtr->private_data = filePtr->private_data;
-		sessionDataPtr->oldFops = filePtr->f_op;
+	fput(commitFilePtr);
+	return ret;
+}
 
-		// Atomically switch file operations
-		xchg(&filePtr->f_op, &session_fops);
+/*
+ * Adds to the undo transaction the contents of the file the write back of the session is about to overwrite:
+ * the blocks differing from the session buffer, and the tail cut off by a smaller session file. Applying the
+ * transaction brings the file back as it is now. Called with the write lock held
+ * Returns 0 on success, or a negative error
+ * @filePtr: a pointer to a file struct, using the original file operations
+ * @sessionDataPtr: the session
+ * @undo: the transaction
+ */
+static int _sessionSaveOverwritten(struct file *filePtr,
+		sessionData *sessionDataPtr, sessionJournalTxn *undo) {
+	struct address_space *mapping = filePtr->f_mapping;
+	unsigned long size = sessionDataPtr->fileInBufferSize;
+	loff_t fileSize = i_size_read(_fileInode(filePtr));
+	unsigned long blocks = DIV_ROUND_UP(fileSize, PAGE_CACHE_SIZE);
+	unsigned long block;
+	loff_t start;
+	struct page *page;
+	char *pageAddr;
+	int ret;
 
-		// Switch session and private data
-		filePtr->private_data = (void*) sessionDataPtr;
+	// The file written back through is write only, the old contents are read through the page cache
+	if (!_mappingCanReadPages(mapping)) {
+		return -EOPNOTSUPP;
+	}
 
-		// Unlock session FOPS
-		atomic_set(&sessionDataPtr->usageCountAndFlag,0);
+	get_file(filePtr);
+	ret = sessionJournalAddFile(undo, filePtr, fileSize);
+	if (ret < 0) {
+		return ret;
+	}
 
-		printk(KERN_ERR "Open Switch Done\n");
+	for (block = 0; block < blocks; block++) {
+		start = (loff_t) block << PAGE_CACHE_SHIFT;
+		if (start < size && (fileSize <= size || start + PAGE_CACHE_SIZE <= size)
+				&& _sessionBlockUnchanged(filePtr, sessionDataPtr, block, size)) {
+			continue;
+		}
 
-		// Locks the module until the session exists
-		try_module_get(THIS_MODULE );
+		page = read_mapping_page(mapping, block, filePtr);
+		if (IS_ERR(page)) {
+			return PTR_ERR(page);
+		}
+		pageAddr = kmap(page);
+		ret = sessionJournalAddExtent(undo, pageAddr, start,
+				min_t(loff_t, fileSize - start, PAGE_CACHE_SIZE));
+		kunmap(page);
+		page_cache_release(page);
+		if (ret < 0) {
+			return ret;
+		}
 	}
 
 	return 0;
 }
 
 /*
- * Session Read File Operation
- * Runs concurrently against other reads and writes, except when reading the current  size of the stored file
+ * Writes back every member of the group in one batch. The members still open are written through a file
+ * opened here, the released ones through the file opened on their release. The group commit lock keeps
+ * the sessions being opened from copying in the files of a group written only in part, and the plug lets
+ * the block layer merge the writes across the files. If the file of a checked member changed since its
+ * base, no member is written and -ESTALE is returned. Through the journal the members are committed in a
+ * single transaction, hence written all or none even across a crash. Without it, the contents each member
+ * overwrites are saved first, and if a member fails the members already written get them back, so that the
+ * files end up all written or none. Readers without a session can see the members written meanwhile, and
+ * a crash in between leaves them written. Called with the group lock held
  */
-ssize_t sessionRead(struct file * filePtr, char __user * buff, size_t count,
-loff_t * pos) {
-	ssize_t ret;
-	char *addr;
+static int _sessionGroupCommit(sessionGroup *group) {
+	sessionData *member;
+	sessionJournalTxn *txn = NULL;
+	sessionJournalTxn *undo = NULL;
+	struct blk_plug plug;
+	int ret = 0;
+	int undoRet;
+
+	// All the files are opened first, so that a failure writes nothing
+	list_for_each_entry(member, &group->members, groupList) {
+		if (member->filePtr == NULL
+				|| !_sessionCanCommit(member->filePtr, member)) {
+			continue;
+		}
+		member->commitFilePtr = _openFileForWrite(member->filePtr);
+		if (IS_ERR(member->commitFilePtr)) {
+			ret = PTR_ERR(member->commitFilePtr);
+			member->commitFilePtr = NULL;
+			goto out;
+		}
+	}
 
-	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
-	if(_atomicIncUnlessSet(&getSessionData(filePtr)->usageCountAndFlag,BADSTATEFLAG) < 0 ){
-		printk(KERN_ERR "Session Data in Bad State\n");
-		return -EBADFD;
+	list_for_each_entry(member, &group->members, groupList) {
+		if (member->commitFilePtr != NULL) {
+			_sessionMaterializeInode(_fileInode(member->commitFilePtr));
+		}
 	}
 
-	// Check if the given pos is inside the file in buffer size, taking the lock
-	// protecting the field in read mode
-	down_read(&getSessionData(filePtr) ->fileInBufferLock);
-	if (*pos > getSessionData(filePtr) ->fileInBufferSize) {
-		up_read(&getSessionData(filePtr) ->fileInBufferLock);
-		printk(KERN_WARNING "Requested read overflows session buffer\n");
-		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
-		return -EOVERFLOW;
+	down_write(&groupCommitLock);
+
+	// Excludes the single write backs too, hence the bases can't move until the writes are done
+	list_for_each_entry(member, &group->members, groupList) {
+		if (member->commitFilePtr == NULL) {
+			continue;
+		}
+		ret = sessionJournalSync(_fileInode(member->commitFilePtr));
+		if (ret == 0 && member->checked
+				&& _sessionBaseChanged(member->commitFilePtr, member)) {
+			ret = -ESTALE;
+		}
+		if (ret < 0) {
+			up_write(&groupCommitLock);
+			goto out;
+		}
 	}
 
-	// Limit the read to the file in buffer size
-	if ((*pos + count) > getSessionData(filePtr) ->fileInBufferSize) {
-		count = getSessionData(filePtr) ->fileInBufferSize - *pos;
+	if (sessionJournalEnabled) {
+		txn = sessionJournalBegin();
+	} else {
+		undo = sessionJournalBegin();
+	}
+	if (txn == NULL && undo == NULL) {
+		ret = -ENOMEM;
+		up_write(&groupCommitLock);
+		goto out;
 	}
-	up_read(&getSessionData(filePtr) ->fileInBufferLock);
 
-	addr = getSessionData(filePtr) ->buffer;
+	blk_start_plug(&plug);
+	list_for_each_entry(member, &group->members, groupList) {
+		if (member->commitFilePtr == NULL) {
+			continue;
+		}
+		mutex_lock(&member->writeLock);
+		if (undo != NULL) {
+			ret = _sessionSaveOverwritten(member->commitFilePtr, member, undo);
+		}
+		if (ret == 0) {
+			ret = _commitSessionBuffer(member->commitFilePtr, member, txn);
+		}
+		if (ret == 0) {
+			_sessionHashBlocks(member, member->fileInBufferSize);
+			_sessionRebase(member->commitFilePtr, member);
+		}
+		mutex_unlock(&member->writeLock);
+		if (ret < 0) {
+			break;
+		}
+	}
+	blk_finish_plug(&plug);
 
-	// Performs the write (copy) of buff on the session buffer
-	ret = copy_to_user(buff, &addr[*pos], count); //ret = number of non copied bytes
-	*pos = *pos + count - ret;
+	if (txn != NULL) {
+		if (ret == 0) {
+			ret = sessionJournalCommit(txn);
+		} else {
+			sessionJournalAbort(txn);
+		}
+	} else if (ret == 0) {
+		sessionJournalAbort(undo);
+	} else {
+		// The members written so far get back what they overwrote
+		undoRet = sessionJournalApply(undo);
+		if (undoRet < 0) {
+			printk(KERN_ERR "Can't undo a group commit failed in part %d\n", undoRet);
+		}
+	}
 
-	// Decrements the usage count
-	atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
-	return count - ret;
+	// The members took their hashes and bases on contents never committed, the next write back of each
+	// must write every block, and a checked one must take its file as changed
+	if (ret < 0) {
+		list_for_each_entry(member, &group->members, groupList) {
+			if (member->commitFilePtr == NULL) {
+				continue;
+			}
+			mutex_lock(&member->writeLock);
+			member->hashedBlocks = 0;
+			member->droppedBlocks = 0;
+			member->baseChecksumValid = 0;
+			mutex_unlock(&member->writeLock);
+		}
+	}
+	up_write(&groupCommitLock);
+
+out:
+	list_for_each_entry(member, &group->members, groupList) {
+		if (member->filePtr != NULL && member->commitFilePtr != NULL) {
+			fput(member->commitFilePtr);
+			member->commitFilePtr = NULL;
+		}
+	}
+	return ret;
 }
 
 /*
- * Session Write File Operation
- * Runs concurrently against reads, but exclusively against other writes taking the write lock
+ * Joins the session to the group of the session open on fd, creating the group if that session has none
+ * Returns 0 on success, -EBADF if fd is not open, -EINVAL if it is not another session, -EBUSY if the session
+ * already belongs to a group
  */
-ssize_t sessionWrite(struct file * filePtr, const char __user * buff,
-size_t count, loff_t * pos) {
-	ssize_t ret;
-	char *addr;
-
-	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
-	if(_atomicIncUnlessSet(&getSessionData(filePtr)->usageCountAndFlag,BADSTATEFLAG) < 0 ){
-		printk(KERN_ERR "Session Data in Bad State\n");
-		return -EBADFD;
+static int _sessionJoin(struct file *filePtr, sessionData *sessionDataPtr,
+		int fd) {
+	struct file *otherFilePtr;
+	sessionData *otherDataPtr;
+	sessionGroup *group;
+	int ret = 0;
+
+	// The reference keeps the other session alive while joining
+	otherFilePtr = fget(fd);
+	if (otherFilePtr == NULL ) {
+		return -EBADF;
 	}
+	if (otherFilePtr == filePtr || !sessionIsSession(otherFilePtr)) {
+		fput(otherFilePtr);
+		return -EINVAL;
+	}
+	otherDataPtr = getSessionData(otherFilePtr);
 
-	// Check if the given pos is inside the buffer
-	if (*pos >= maxBufferSize) {
-		printk(KERN_WARNING "Requested write overflows session buffer\n");
-		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
-		return -EOVERFLOW;
+	mutex_lock(&groupJoinLock);
+
+	if (sessionDataPtr->group != NULL ) {
+		ret = -EBUSY;
+		goto out;
 	}
 
-	// Limit the read to the buffer size
-	if ((count + *pos) > maxBufferSize) {
-		count = maxBufferSize - *pos;
+	group = otherDataPtr->group;
+	if (group == NULL ) {
+		group = (sessionGroup*) kmalloc(sizeof(sessionGroup), KAMLLOCFLAGS);
+		if (group == NULL ) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		mutex_init(&group->lock);
+		INIT_LIST_HEAD(&group->members);
+		list_add_tail(&otherDataPtr->groupList, &group->members);
+		group->openMembers = 1;
+		otherDataPtr->group = group;
 	}
 
-	mutex_lock(&getSessionData(filePtr) ->writeLock);
+	mutex_lock(&group->lock);
+	list_add_tail(&sessionDataPtr->groupList, &group->members);
+	group->openMembers++;
+	sessionDataPtr->group = group;
+	mutex_unlock(&group->lock);
 
-	addr = getSessionData(filePtr) ->buffer;
+out:
+	mutex_unlock(&groupJoinLock);
+	fput(otherFilePtr);
+	return ret;
+}
 
-	// Performs the "read" (copy) from the session buffer to buff
-	ret = copy_from_user(&addr[*pos], buff, count); //ret = number of non copied bytes
+/*
+ * Releases a member of a group. The member is kept until the last member is released, then the whole group
+ * is written back at once and freed
+ * Returns the result of the group commit, if it took place
+ * @filePtr: the session file, already switched back to the original file operations
+ * @sessionDataPtr: the released member
+ * @freed: set if the group, hence the member, has been freed
+ */
+static int _sessionGroupRelease(struct file *filePtr,
+		sessionData *sessionDataPtr, int *freed) {
+	sessionGroup *group = sessionDataPtr->group;
+	sessionData *member;
+	sessionData *next;
+	int ret;
 
-	// Check if we must update the size of the stored file
-	if (getSessionData(filePtr) ->fileInBufferSize < (*pos + (count - ret))) {
-		// Since write are not executed concurrently , we only need to avoid some read to check the size of the
-		// stored file when we are updating it
-		down_write(&getSessionData(filePtr) ->fileInBufferLock);
-		getSessionData(filePtr) ->fileInBufferSize = *pos + (count - ret);
-		up_write(&getSessionData(filePtr) ->fileInBufferLock);
+	*freed = 0;
+
+	// The member is written back through a file outliving the session file
+	if (_sessionCanCommit(filePtr, sessionDataPtr)) {
+		sessionDataPtr->commitFilePtr = _openFileForWrite(filePtr);
+		if (IS_ERR(sessionDataPtr->commitFilePtr)) {
+			printk(KERN_WARNING "Can't keep the session for its group, changes lost\n");
+			sessionDataPtr->commitFilePtr = NULL;
+		}
 	}
 
-	mutex_unlock(&getSessionData(filePtr) ->writeLock);
+	mutex_lock(&group->lock);
+	sessionDataPtr->filePtr = NULL;
+	if (--group->openMembers > 0) {
+		mutex_unlock(&group->lock);
+		return 0;
+	}
 
-	*pos = *pos + count - ret;
-	// Decrements the usage count
-	atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
-	return count - ret;
+	ret = _sessionGroupCommit(group);
+	mutex_unlock(&group->lock);
+
+	// No member is open anymore, nobody else can reach the group
+	list_for_each_entry_safe(member, next, &group->members, groupList) {
+		list_del(&member->groupList);
+		if (member->commitFilePtr != NULL ) {
+			fput(member->commitFilePtr);
+		}
+		_sessionFree(member);
+		_sessionRelease();
+		// The caller drops the reference of the member being released
+		if (member != sessionDataPtr) {
+			module_put(THIS_MODULE );
+		}
+	}
+	mutex_destroy(&group->lock);
+	kfree(group);
+
+	*freed = 1;
+	return ret;
 }
 
 /*
- * Session llseek File Operation
- * Mimicks the generic_file_llseek, returning errors on non supported operations and avoiding that pos overflows the
- * maximum buffer size
+ * Session ioctl File Operation, controlling the session without closing it
+ * SESSION_IOC_COMMIT writes back the session buffer, SESSION_IOC_ABORT discards the session on close,
+ * SESSION_IOC_REFRESH reloads the session buffer from the file, SESSION_IOC_JOIN joins the session to a group
+ * and SESSION_IOC_GROUP_COMMIT writes back the whole group. SESSION_IOC_CHECKED makes the write backs fail
+ * if the file changed since the session copied it in
  */
-
-loff_t sessionLlseek(struct file *filePtr, loff_t offset, int origin) {
-	int ret;
-	loff_t maxsize = maxBufferSize;
+long sessionIoctl(struct file *filePtr, unsigned int cmd, unsigned long arg) {
+	sessionData* sessionDataPtr = getSessionData(filePtr);
+	long ret;
 
 	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
-	if(_atomicIncUnlessSet(&getSessionData(filePtr)->usageCountAndFlag,BADSTATEFLAG) < 0 ){
+	if(_statIncUnlessSet(&sessionDataPtr->usageCountAndFlag) < 0 ){
 		printk(KERN_ERR "Session Data in Bad State\n");
 		return -EBADFD;
 	}
 
-	switch (origin) {
-	case SEEK_END:
-		offset += getSessionData(filePtr) ->fileInBufferSize;
+	switch (cmd) {
+	case SESSION_IOC_COMMIT:
+		ret = _sessionCommitInPlace(filePtr, sessionDataPtr);
 		break;
-
-	case SEEK_CUR:
-		if (offset == 0){
-			// Decrements the usage count
-			atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
-			return filePtr->f_pos;
+	case SESSION_IOC_ABORT:
+		sessionAbort(filePtr);
+		ret = 0;
+		break;
+	case SESSION_IOC_REFRESH:
+		ret = _sessionRefresh(filePtr, sessionDataPtr);
+		break;
+	case SESSION_IOC_JOIN:
+		ret = _sessionJoin(filePtr, sessionDataPtr, (int) arg);
+		break;
+	case SESSION_IOC_GROUP_COMMIT:
+		if (sessionDataPtr->group == NULL ) {
+			ret = _sessionCommitInPlace(filePtr, sessionDataPtr);
+			break;
 		}
-
-		spin_lock(&filePtr->f_lock);
-		offset = _lseekExecute(filePtr, filePtr->f_pos + offset, maxsize);
-		spin_unlock(&filePtr->f_lock);
-
-		// Decrements the usage count
-		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
-		return offset;
+		mutex_lock(&sessionDataPtr->group->lock);
+		ret = _sessionGroupCommit(sessionDataPtr->group);
+		mutex_unlock(&sessionDataPtr->group->lock);
 		break;
-	case SEEK_DATA:
-		// Decrements the usage count
-		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
-		return -ENOTSUPP;
+	case SESSION_IOC_CHECKED:
+		sessionDataPtr->checked = 1;
+		ret = 0;
 		break;
-	case SEEK_HOLE:
-		// Decrements the usage count
-		atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
-		return -ENOTSUPP;
+	default:
+		ret = -ENOTTY;
 		break;
 	}
-	ret = _lseekExecute(filePtr, offset, maxsize);
+
 	// Decrements the usage count
-	atomic_dec(&getSessionData(filePtr) ->usageCountAndFlag);
+	atomic_dec(&sessionDataPtr->usageCountAndFlag);
 	return ret;
 }
 
-
 /*
  * Session Flush File Operation
- * If this file operation is called, then a close has been requested, hence we tear down the session and write
- * back the data stored in the session buffer to the related file
+ * Runs on every close of a descriptor sharing the session file, after a dup or a fork too, hence it leaves
+ * the session alone. If checkpointOnFlush is set the session buffer is written back, and the session goes on.
+ * A checked session whose file changed since its base fails the close with -ESTALE, the release will not
+ * write it back
  */
 int sessionFlush(struct file * filePtr, fl_owner_t id) {
-	sessionData* sessionDataPtr;
+	sessionData* sessionDataPtr = getSessionData(filePtr);
 	int ret;
-	loff_t pos = 0;
-	size_t fileInBufferSize = 0;
-	loff_t oldPos = 0;
 
-	// Check if the related file is writable
-	if (!(filePtr->f_mode & FMODE_WRITE )) {
-		printk(KERN_WARNING "File is not writable\n");
-		return -EBADF;
-	}
+	_trace(SESSION_TRACE_FLUSH, sessionDataPtr, filePtr->f_pos, 0, 0);
 
-	sessionDataPtr = getSessionData(filePtr);
+	if (!_sessionCanCommit(filePtr, sessionDataPtr)
+			|| (likely(!checkpointOnFlush) && !sessionDataPtr->checked)) {
+		return 0;
+	}
 
-	// If the bad state bit is already set it returns an error, otherwise it sets the bit
-	if(_atomicSetUnlessSet(&sessionDataPtr->usageCountAndFlag, BADSTATEFLAG) < 0){
+	// Check if the bad state flag is raised. If not it increments the usage count, otherwise returns with an error
+	if(_statIncUnlessSet(&sessionDataPtr->usageCountAndFlag) < 0 ){
 		printk(KERN_ERR "Session Data in Bad State\n");
 		return -EBADFD;
 	}
 
-	// Loops until no fops is running
+	// The members of a group are written back only together
+	if (checkpointOnFlush && sessionDataPtr->group == NULL) {
+		ret = _sessionCommitInPlace(filePtr, sessionDataPtr);
+	} else {
+		ret = sessionJournalSync(_fileInode(filePtr));
+		if (ret == 0 && sessionDataPtr->checked
+				&& _sessionBaseChanged(filePtr, sessionDataPtr)) {
+			ret = -ESTALE;
+		}
+	}
+
+	// Decrements the usage count
+	atomic_dec(&sessionDataPtr->usageCountAndFlag);
+	return ret;
+}
+
+/*
+ * Session Release File Operation
+ * Runs once the last reference to the session file is gone, hence we tear down the session, write back the
+ * data stored in the session buffer to the related file and let the original file operations release it.
+ * The file goes away anyway, a failed write back is only reported
+ */
+int sessionRelease(struct inode *inode, struct file *filePtr) {
+	sessionData* sessionDataPtr = getSessionData(filePtr);
+	int ret = 0;
+	int releaseRet = 0;
+	int freed = 1;
+
+	_trace(SESSION_TRACE_RELEASE, sessionDataPtr, filePtr->f_pos, 0, 0);
+
+	// Nobody can start a new fops on a released file, wait for the ones still running
+	_atomicSetUnlessSet(&sessionDataPtr->usageCountAndFlag, BADSTATEFLAG);
 	while(atomic_read(&sessionDataPtr->usageCountAndFlag) != BADSTATEFLAG){
 		msleep(1);
 	};
 
+	// The writers must not look for the session anymore
+	if (sessionDataPtr->deferred) {
+		mutex_lock(&deferredLock);
+		_sessionUnregisterDeferred(sessionDataPtr);
+		mutex_unlock(&deferredLock);
+	}
+
 	// Switches back the private data
 	filePtr->private_data = sessionDataPtr->private_data;
-	// Atomically switch back the fops
+	// Atomically switch back the fops, the VFS drops the reference on them after we return
 	xchg(&filePtr->f_op, sessionDataPtr->oldFops);
 
-	fileInBufferSize = sessionDataPtr->fileInBufferSize;
-	ret = -1;
-
-	// Save the current pos and reset it to the beginning of the file
-	spin_lock(&filePtr->f_lock);
-	oldPos = filePtr->f_pos;
-	spin_unlock(&filePtr->f_lock);
-	filePtr->f_op->llseek(filePtr, 0, SEEK_SET);
-
-	// Writes the content of the buffer on the file
-	do {
-		pos = filePtr->f_pos;
-
-		ret = _writeSessionBufferToFile(filePtr, sessionDataPtr->buffer,
-		fileInBufferSize, pos);
-
-		filePtr->f_pos = pos;
-		if (ret < 0) {
-			printk(
-					KERN_WARNING "Error while committing the sessione buffer to file %d\n",
-					ret);
-
-			// Rolls back to pre flush situation
-			xchg(&filePtr->f_op, &session_fops);
-			filePtr->private_data = (void*) sessionDataPtr;
-			atomic_set(&sessionDataPtr->usageCountAndFlag, 0);
-
-			spin_lock(&filePtr->f_lock);
-			filePtr->f_pos = oldPos;
-			spin_unlock(&filePtr->f_lock);
-			return ret;
+	if (sessionDataPtr->group != NULL ) {
+		// The member waits for the rest of its group
+		ret = _sessionGroupRelease(filePtr, sessionDataPtr, &freed);
+	} else {
+		// Writes the changed contents of the buffer on the file, unless the session could not write or has been aborted
+		if (_sessionCanCommit(filePtr, sessionDataPtr)) {
+			_sessionMaterializeInode(inode);
+			down_read(&groupCommitLock);
+			mutex_lock(_commitLockFor(inode));
+			ret = sessionJournalSync(inode);
+			if (ret < 0) {
+				printk(KERN_WARNING "Session file misses a journaled write back, changes discarded\n");
+			} else if (sessionDataPtr->checked
+					&& _sessionBaseChanged(filePtr, sessionDataPtr)) {
+				printk(KERN_WARNING "Session file changed meanwhile, changes discarded\n");
+				ret = -ESTALE;
+			} else {
+				ret = _commitSessionBufferOnRelease(filePtr, sessionDataPtr);
+			}
+			mutex_unlock(_commitLockFor(inode));
+			up_read(&groupCommitLock);
 		}
-		pos += ret;
-		fileInBufferSize -= ret;
-	} while (fileInBufferSize > 0);
 
-	// The file may have grown, hence we must truncate it to the size of the session file
-	_doTruncate(filePtr->f_dentry, sessionDataPtr->fileInBufferSize, 0,
-			NULL );
+		// Freeing session meta data
+		_sessionFree(sessionDataPtr);
 
-	// Freeing session meta data
-	free_pages((unsigned long) sessionDataPtr->buffer, maxBufferOrder);
-	mutex_destroy(&sessionDataPtr->writeLock);
-	kfree(sessionDataPtr);
+		// Reduce the number of active sessions
+		_sessionRelease();
+	}
+	if (ret < 0) {
+		printk(
+				KERN_WARNING "Error while committing the sessione buffer to file %d\n",
+				ret);
+	}
 
-	// Reduce the number of active sessions and the usage counter of the module
-	atomic_dec(&sessionCount);
-	module_put(THIS_MODULE );
+	if (filePtr->f_op->release != NULL ) {
+		releaseRet = filePtr->f_op->release(inode, filePtr);
+	}
 
-	return 0;
-}
+	// Reduce the usage counter of the module, a member of a group holds it until the group is freed
+	if (freed) {
+		module_put(THIS_MODULE );
+	}
 
+	return ret < 0 ? ret : releaseRet;
+}
@@ -12,7 +12,49 @@
 #ifndef SESSIONFILEOPERATIONS_H_
 #define SESSIONFILEOPERATIONS_H_
 
-int sessionInit(int maxSession, int bufferOrder);
-int sessionOpen(struct file *filePtr, int flags);
+#include <linux/types.h>
+#include <linux/fs.h>
+
+#include "sessionCompat.h"
+
+#define SESSION_NODE_OPENER 0 // Session buffers are allocated on the node of the opening CPU
+#define SESSION_NODE_FIRSTACCESS 1 // Session buffers are moved to the node of the first CPU accessing them
+
+// Time spent by a CPU waiting on the session locks, in nanoseconds
+struct sessionLockStat {
+	u64 usageWait; // Taking a reference on usageCountAndFlag
+	u64 fileInBufferLockWait; // Waiting on fileInBufferLock
+	u64 writeLockWait; // Waiting on writeLock
+};
+
+int sessionInit(int maxSession, int bufferOrder, int bufferPolicy, int poolSize);
+void sessionExit(void);
+int sessionSetMaxSession(int maxSession);
+int sessionSetBufferOrder(int bufferOrder);
+int sessionSetPoolSize(int poolSize);
+int sessionOpen(struct file *filePtr, int flags, int mode);
+int sessionRealOpenFlags(int flags);
+int sessionReserve(int count);
+void sessionUnreserve(int count);
+void sessionPrefetch(struct file *filePtr);
+int sessionOpenReserved(struct file *filePtr, int flags, int mode);
+int sessionIsSession(struct file *filePtr);
+void sessionAbort(struct file *filePtr);
+long sessionTruncate(struct file *filePtr, loff_t length);
+void sessionWriterFile(struct file *filePtr);
+void sessionWriterInode(struct inode *inode);
+
+ssize_t sessionRead(struct file * filePtr, char __user * buff, size_t count,
+		loff_t * pos);
+ssize_t sessionWrite(struct file * filePtr, const char __user * buff,
+		size_t count, loff_t * pos);
+loff_t sessionLlseek(struct file *filePtr, loff_t offset, int origin);
+#ifdef SESSION_HAVE_ITER
+ssize_t sessionReadIter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t sessionWriteIter(struct kiocb *iocb, struct iov_iter *from);
+#endif
+
+void sessionLockStatEnable(int enable);
+void sessionLockStatRead(int cpu, struct sessionLockStat *stat);
 
 #endif /* SESSIONFILEOPERATIONS_H_ */
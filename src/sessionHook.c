@@ -0,0 +1,376 @@
+/*
+ ============================================================================
+ Name        : sessionHook.c
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Implementation of the session open for current x86_64 kernels.
+ 	 The system call table is read only and not exported there, hence open
+ 	 and openat are hooked through ftrace: the tracer callback diverts the
+ 	 syscall entry to a wrapper, which calls the original syscall and then
+ 	 calls sessionOpen. The opens of every file and its size changes are
+ 	 hooked the same way, so that the sessions deferring their copy-in see
+ 	 all the writers, whatever syscall or kernel user they come from.
+ 	 ftruncate is hooked to resize the session files, and the batched
+ 	 session open is an ioctl of the control device, as no syscall can be
+ 	 added. Requires a kernel with DYNAMIC_FTRACE_WITH_REGS and SECURITY
+ ============================================================================
+ */
+#include <linux/kernel.h>
+#include <linux/linkage.h>
+#include <linux/file.h>
+#include <linux/fdtable.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/ftrace.h>
+#include <linux/kprobes.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "Defines.h"
+#include "sessionFileOperations.h"
+#include "sessionBatch.h"
+#include "sessionsyscall.h"
+
+#ifndef CONFIG_X86_64
+#error "The ftrace based session open supports x86_64 only"
+#endif
+
+// Every open of a file goes through security_file_open, which is an empty inline without it
+#ifndef CONFIG_SECURITY
+#error "The ftrace based session open requires CONFIG_SECURITY"
+#endif
+
+struct sessionHook_struct {
+	const char *name; // Name of the hooked entry
+	void *function; // Wrapper replacing the entry
+	void *original; // Pointer to the function pointer used to call the original entry
+	unsigned long address; // Address of the entry
+	struct ftrace_ops ops; // Ftrace registration
+};
+
+typedef struct sessionHook_struct sessionHook;
+
+typedef asmlinkage long (*syscallEntry)(const struct pt_regs *regs);
+typedef int (*fileOpenEntry)(struct file *file);
+
+// notify_change takes the idmap of the mount first on current kernels
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+typedef struct mnt_idmap *sessionIdmap;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+typedef struct user_namespace *sessionIdmap;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+typedef int (*notifyChangeEntry)(sessionIdmap idmap, struct dentry *dentry,
+		struct iattr *attr, struct inode **delegated);
+#else
+typedef int (*notifyChangeEntry)(struct dentry *dentry, struct iattr *attr,
+		struct inode **delegated);
+#endif
+
+// Original open, openat and ftruncate entries
+static syscallEntry original_open;
+static syscallEntry original_openat;
+static syscallEntry original_ftruncate;
+
+// Original entries of the file opens and of the attribute changes
+static fileOpenEntry original_fileOpen;
+static notifyChangeEntry original_notifyChange;
+
+/*
+ * Creates the session on the file just opened if O_SESSION has been requested, closing it on failure
+ */
+static long _sessionAttach(long fd, int flags, int mode) {
+	struct file *filePtr;
+	int ret;
+
+	if (fd < 0 || !(flags & O_SESSION)) {
+		return fd;
+	}
+
+	filePtr = fget(fd);
+	if (filePtr == NULL ) {
+		return -EBADF;
+	}
+	ret = sessionOpen(filePtr, flags, mode);
+	fput(filePtr);
+
+	if (ret < 0) {
+		// If a failure occurred, close the file
+		_closeFd(fd);
+		return ret;
+	}
+	return fd;
+}
+
+/*
+ * Session open wrapper: open(pathname, flags, mode)
+ */
+static asmlinkage long sessionHookOpen(const struct pt_regs *regs) {
+	struct pt_regs realRegs;
+	int flags = (int) regs->si;
+
+	// A truncation is deferred to the commit of the session, the real open gets the flags without it
+	if (sessionRealOpenFlags(flags) != flags) {
+		realRegs = *regs;
+		realRegs.si = (unsigned int) sessionRealOpenFlags(flags);
+		return _sessionAttach(original_open(&realRegs), flags, (int) regs->dx);
+	}
+	return _sessionAttach(original_open(regs), flags, (int) regs->dx);
+}
+
+/*
+ * Session openat wrapper: openat(dirfd, pathname, flags, mode)
+ */
+static asmlinkage long sessionHookOpenat(const struct pt_regs *regs) {
+	struct pt_regs realRegs;
+	int flags = (int) regs->dx;
+
+	// A truncation is deferred to the commit of the session, the real open gets the flags without it
+	if (sessionRealOpenFlags(flags) != flags) {
+		realRegs = *regs;
+		realRegs.dx = (unsigned int) sessionRealOpenFlags(flags);
+		return _sessionAttach(original_openat(&realRegs), flags, (int) regs->r10);
+	}
+	return _sessionAttach(original_openat(regs), flags, (int) regs->r10);
+}
+
+/*
+ * Ftruncate wrapper: ftruncate(fd, length). On session files it changes the size of the session file only,
+ * otherwise it calls the original ftruncate
+ */
+static asmlinkage long sessionHookFtruncate(const struct pt_regs *regs) {
+	struct file *filePtr;
+	long ret;
+
+	filePtr = fget((unsigned int) regs->di);
+	if (filePtr != NULL && sessionIsSession(filePtr)) {
+		ret = sessionTruncate(filePtr, (loff_t) regs->si);
+		fput(filePtr);
+		return ret;
+	}
+	if (filePtr != NULL ) {
+		fput(filePtr);
+	}
+
+	return original_ftruncate(regs);
+}
+
+/*
+ * File open wrapper: security_file_open(file). Every open goes through it once the file has write access,
+ * before it is returned: open, openat, openat2, io_uring and the opens of the kernel users as nfsd
+ */
+static int sessionHookFileOpen(struct file *file) {
+	sessionWriterFile(file);
+	return original_fileOpen(file);
+}
+
+/*
+ * Attribute change wrapper: notify_change(idmap, dentry, attr, delegated). Every size change goes through it,
+ * truncate, ftruncate, O_TRUNC and the kernel users as nfsd, with the inode lock held
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+static int sessionHookNotifyChange(sessionIdmap idmap, struct dentry *dentry,
+		struct iattr *attr, struct inode **delegated) {
+	if (attr->ia_valid & ATTR_SIZE) {
+		sessionWriterInode(dentry->d_inode);
+	}
+	return original_notifyChange(idmap, dentry, attr, delegated);
+}
+#else
+static int sessionHookNotifyChange(struct dentry *dentry, struct iattr *attr,
+		struct inode **delegated) {
+	if (attr->ia_valid & ATTR_SIZE) {
+		sessionWriterInode(dentry->d_inode);
+	}
+	return original_notifyChange(dentry, attr, delegated);
+}
+#endif
+
+static sessionHook hooks[] = {
+	{ name : "__x64_sys_open", function : sessionHookOpen, original : &original_open },
+	{ name : "__x64_sys_openat", function : sessionHookOpenat, original : &original_openat },
+	{ name : "__x64_sys_ftruncate", function : sessionHookFtruncate, original : &original_ftruncate },
+	{ name : "security_file_open", function : sessionHookFileOpen, original : &original_fileOpen },
+	{ name : "notify_change", function : sessionHookNotifyChange, original : &original_notifyChange },
+};
+
+/*
+ * Calls the original open entry, for the batched session open
+ */
+static long _originalOpen(const char __user *pathname, int flags, int mode) {
+	struct pt_regs regs = { };
+
+	regs.di = (unsigned long) pathname;
+	regs.si = (unsigned int) flags;
+	regs.dx = (unsigned int) mode;
+	return original_open(&regs);
+}
+
+/*
+ * Control device ioctl: SESSION_IOC_OPEN_BATCH opens a batch of files as sessions, as the batched session
+ * open syscall of the system call table build
+ */
+static long _sessionControlIoctl(struct file *filePtr, unsigned int cmd,
+		unsigned long arg) {
+	struct sessionBatchRequest batch;
+
+	if (cmd != SESSION_IOC_OPEN_BATCH) {
+		return -ENOTTY;
+	}
+	if (copy_from_user(&batch, (const void __user *) arg, sizeof(batch))) {
+		return -EFAULT;
+	}
+
+	return sessionOpenBatch((struct sessionOpenRequest __user *) batch.requests,
+			batch.count, _originalOpen);
+}
+
+static const struct file_operations sessionControlFops = {
+	owner : THIS_MODULE,
+	unlocked_ioctl : _sessionControlIoctl,
+};
+
+static struct miscdevice sessionControl = {
+	minor : MISC_DYNAMIC_MINOR,
+	name : "session",
+	fops : &sessionControlFops,
+	mode : 0666,
+};
+
+/*
+ * kallsyms_lookup_name is not exported anymore, its address is taken from a kprobe placed on it
+ */
+static unsigned long _lookupName(const char *name) {
+	typedef unsigned long (*kallsymsLookupName)(const char *name);
+	static kallsymsLookupName lookupName = NULL;
+	struct kprobe kp = { symbol_name : "kallsyms_lookup_name" };
+
+	if (lookupName == NULL ) {
+		if (register_kprobe(&kp) < 0) {
+			return 0;
+		}
+		lookupName = (kallsymsLookupName) kp.addr;
+		unregister_kprobe(&kp);
+	}
+
+	return lookupName(name);
+}
+
+/*
+ * Ftrace callback, diverts the hooked entry to the wrapper unless the call comes from the module itself
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+static void notrace _sessionHookCallback(unsigned long ip, unsigned long parent_ip,
+		struct ftrace_ops *ops, struct ftrace_regs *fregs) {
+	struct pt_regs *regs = ftrace_get_regs(fregs);
+#else
+static void notrace _sessionHookCallback(unsigned long ip, unsigned long parent_ip,
+		struct ftrace_ops *ops, struct pt_regs *regs) {
+#endif
+	sessionHook *hook = container_of(ops, sessionHook, ops);
+
+	if (!within_module(parent_ip, THIS_MODULE)) {
+		regs->ip = (unsigned long) hook->function;
+	}
+}
+
+/*
+ * Installs a hook
+ */
+static int _installHook(sessionHook *hook) {
+	int ret;
+
+	hook->address = _lookupName(hook->name);
+	if (hook->address == 0) {
+		printk(KERN_ERR "Cannot resolve %s\n", hook->name);
+		return -ENOENT;
+	}
+	// The wrapper calls the entry itself, the callback recognizes it and lets the call through
+	*((unsigned long*) hook->original) = hook->address;
+
+	hook->ops.func = _sessionHookCallback;
+	hook->ops.flags = FTRACE_OPS_FL_SAVE_REGS | FTRACE_OPS_FL_IPMODIFY;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	hook->ops.flags |= FTRACE_OPS_FL_RECURSION;
+#else
+	hook->ops.flags |= FTRACE_OPS_FL_RECURSION_SAFE;
+#endif
+
+	ret = ftrace_set_filter_ip(&hook->ops, hook->address, 0, 0);
+	if (ret < 0) {
+		printk(KERN_ERR "Cannot trace %s: %d\n", hook->name, ret);
+		return ret;
+	}
+
+	ret = register_ftrace_function(&hook->ops);
+	if (ret < 0) {
+		printk(KERN_ERR "Cannot hook %s: %d\n", hook->name, ret);
+		ftrace_set_filter_ip(&hook->ops, hook->address, 1, 0);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Removes a hook
+ */
+static void _removeHook(sessionHook *hook) {
+	unregister_ftrace_function(&hook->ops);
+	ftrace_set_filter_ip(&hook->ops, hook->address, 1, 0);
+}
+
+/*
+ * Initialize the session module and installs the hooks
+ */
+int registerSessionSyscall(int maxSession, int bufferOrder, int bufferPolicy,
+		int poolSize) {
+	int ret;
+	int i;
+
+	ret = sessionInit(maxSession, bufferOrder, bufferPolicy, poolSize);
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(hooks); i++) {
+		ret = _installHook(&hooks[i]);
+		if (ret < 0) {
+			goto fail;
+		}
+	}
+
+	ret = misc_register(&sessionControl);
+	if (ret < 0) {
+		printk(KERN_ERR "Cannot register the session control device: %d\n", ret);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	while (--i >= 0) {
+		_removeHook(&hooks[i]);
+	}
+	sessionExit();
+	return ret;
+}
+
+/*
+ * Removes the hooks
+ */
+int unregisterSessionSyscall(void) {
+	int i;
+
+	misc_deregister(&sessionControl);
+	for (i = ARRAY_SIZE(hooks) - 1; i >= 0; i--) {
+		_removeHook(&hooks[i]);
+	}
+
+	sessionExit();
+	return 0;
+}
@@ -0,0 +1,933 @@
+/*
+ ============================================================================
+ Name        : sessionJournal.c
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Write ahead journal of the session write backs. When the
+ 	 journalPath parameter names a file, every write back appends to it
+ 	 the changed extents of the sessions followed by a commit record, and
+ 	 is done once the journal is on the disk. A background worker then
+ 	 writes the extents in place and checkpoints the record, and the
+ 	 following records wrap around over the records checkpointed, within
+ 	 journalMaxSize bytes. The records left past the checkpoint by a crash
+ 	 are applied when the module is loaded again. A record that can't be
+ 	 applied then is kept for the next load, and its files fail with EIO
+ ============================================================================
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/dcache.h>
+#include <linux/string.h>
+#include <linux/crc32.h>
+#include <linux/err.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include "sessionCompat.h"
+#include "sessionJournal.h"
+
+#define JOURNAL_MAGIC 0x4a4e5353 // Start of a record
+#define JOURNAL_COMMIT_MAGIC 0x43545353 // Commit record, closing a record
+#define JOURNAL_ALIGN 8 // Alignment of the parts of a record
+#define JOURNAL_INITIAL_SIZE 65536 // Bytes allocated for a record when the transaction begins
+#define JOURNAL_MAX_RECORD (256 << 20) // Larger records are refused, and taken as garbage on replay
+#define JOURNAL_CHECKPOINT_MAGIC 0x4b435353 // Checkpoint
+#define JOURNAL_SLOT_SIZE 512 // Bytes of each of the two checkpoint slots
+#define JOURNAL_START 4096 // Offset of the first record, the checkpoint slots come before it
+
+// Start of a record, followed by the files it writes
+struct journalHeader {
+	u32 magic;
+	u32 files; // Number of files written
+	u64 seq; // Sequence number of the record
+	u64 length; // Bytes of the record, the header included and the commit record excluded
+};
+
+// File written by a record, followed by its path and by the extents written in it
+struct journalFile {
+	u64 size; // Size of the file once written
+	u32 pathLength; // Bytes of the path, without terminator
+	u32 extents; // Number of extents written
+};
+
+// Extent written in a file, followed by its contents
+struct journalExtent {
+	u64 offset;
+	u64 length;
+};
+
+// Commit record, a record not followed by it has not been committed
+struct journalCommit {
+	u32 magic;
+	u32 crc; // crc32 of the record
+	u64 seq; // Sequence number of the record
+};
+
+// Checkpoint, written alternately in the two slots at the start of the journal: the records up to seq have
+// been applied, and the replay starts from head. A checkpoint torn by a crash leaves the previous one whole
+struct journalCheckpoint {
+	u32 magic;
+	u32 crc; // crc32 of the checkpoint, computed with crc zero
+	u64 seq; // Sequence number of the last record applied
+	u64 head; // Offset following that record
+};
+
+struct sessionJournalTxn_struct {
+	char *record; // Record of the transaction, as appended to the journal
+	size_t used; // Bytes of the record filled
+	size_t size; // Bytes allocated for the record
+	size_t fileOffset; // Offset in the record of the last file added
+	struct file **files; // File each file of the record is written through, in record order
+	int fileCount; // Number of files added
+	int fileSlots; // Entries allocated in files
+	u64 seq; // Sequence number of the record, once committed
+	loff_t start; // Offset of the record in the journal, once committed
+	loff_t end; // Offset following its commit record, once committed
+	int failed; // Set if the record could not be applied, it stays pending until the next load replays it
+	struct list_head pendingList; // Link in the transactions not applied yet
+	struct work_struct work; // Applies the transaction
+};
+
+// Set if the write backs go through the journal
+int sessionJournalEnabled = 0;
+
+static char *journalPath = NULL;
+module_param(journalPath, charp, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(journalPath, "File journaling the session write backs, none if empty");
+
+static long journalMaxSize = 64 << 20;
+module_param(journalMaxSize, long, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(journalMaxSize, "Bytes the journal spans at most, a write back waits for room while the records before it are applied");
+
+static const struct sessionJournalOps *journalOps = NULL;
+static struct file *journalFilePtr = NULL;
+static DEFINE_MUTEX(journalLock); // Serializes the appends to the journal
+static loff_t journalTail = JOURNAL_START; // Offset following the last record, protected by journalLock
+static u64 journalSeq = 0; // Sequence number of the last record, protected by journalLock
+static unsigned int checkpointCount = 0; // Checkpoints written, the next one goes in slot checkpointCount & 1
+static int journalBroken = 0; // Set if a record could not be applied, the journal is kept for the next load
+static DEFINE_SPINLOCK(pendingLock); // Protects pendingTxns and the failed flags
+static LIST_HEAD(pendingTxns); // Transactions appended and not applied yet, in append order
+static DECLARE_WAIT_QUEUE_HEAD(appliedQueue); // Woken up whenever a transaction has been applied
+static struct workqueue_struct *applyQueue = NULL; // Ordered, the records are applied in append order
+
+/*
+ * Rounds the length of a part of a record up to the alignment of the next part
+ */
+static inline size_t _journalAlign(size_t length) {
+	return ALIGN(length, JOURNAL_ALIGN);
+}
+
+/*
+ * Reads exactly count bytes of the file at pos
+ * Returns 0 on success, or a negative error
+ */
+static int _journalRead(struct file *filePtr, char *buffer, size_t count,
+		loff_t pos) {
+	ssize_t ret;
+
+	ret = journalOps->read(filePtr, buffer, count, pos);
+	if (ret < 0) {
+		return ret;
+	}
+	return ret == count ? 0 : -EIO;
+}
+
+/*
+ * Writes count bytes at pos of the file
+ * Returns 0 on success, or a negative error
+ */
+static int _journalWrite(struct file *filePtr, const char *buffer,
+		size_t count, loff_t pos) {
+	ssize_t ret;
+
+	while (count > 0) {
+		ret = journalOps->write(filePtr, buffer, count, pos);
+		if (ret < 0) {
+			return ret;
+		}
+		if (ret == 0) {
+			return -EIO;
+		}
+		buffer += ret;
+		pos += ret;
+		count -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the files as the record says, and flushes them to the disk. The files are the ones the record has
+ * been built with, or NULL on replay, where they are opened by path and the files gone meanwhile are skipped
+ * Returns 0 on success, or a negative error
+ * @record: the record, header included
+ * @length: bytes of the record
+ * @files: files the record is written through, or NULL
+ */
+static int _journalApplyRecord(const char *record, size_t length,
+		struct file **files) {
+	const struct journalHeader *header = (const struct journalHeader*) record;
+	const struct journalFile *entry;
+	const struct journalExtent *extent;
+	size_t offset = sizeof(struct journalHeader);
+	struct file *filePtr;
+	char *path;
+	u32 file;
+	u32 i;
+	int ret = 0;
+
+	for (file = 0; file < header->files; file++) {
+		entry = (const struct journalFile*) &record[offset];
+		if (offset + sizeof(struct journalFile) > length
+				|| offset + sizeof(struct journalFile)
+						+ _journalAlign(entry->pathLength) > length) {
+			return -EINVAL;
+		}
+		offset += sizeof(struct journalFile) + _journalAlign(entry->pathLength);
+
+		if (files != NULL) {
+			filePtr = files[file];
+		} else {
+			path = kstrndup((const char*) &entry[1], entry->pathLength,
+					GFP_KERNEL);
+			if (path == NULL) {
+				return -ENOMEM;
+			}
+			filePtr = filp_open(path, O_WRONLY | O_LARGEFILE, 0);
+			if (IS_ERR(filePtr)) {
+				printk(KERN_WARNING "Can't replay the journal on %s, skipped\n", path);
+				filePtr = NULL;
+			}
+			kfree(path);
+		}
+
+		for (i = 0; i < entry->extents; i++) {
+			extent = (const struct journalExtent*) &record[offset];
+			if (offset + sizeof(struct journalExtent) > length
+					|| offset + sizeof(struct journalExtent)
+							+ _journalAlign(extent->length) > length) {
+				ret = -EINVAL;
+				break;
+			}
+			if (filePtr != NULL) {
+				ret = _journalWrite(filePtr, (const char*) &extent[1],
+						extent->length, extent->offset);
+				if (ret < 0) {
+					break;
+				}
+			}
+			offset += sizeof(struct journalExtent) + _journalAlign(extent->length);
+		}
+
+		if (filePtr == NULL) {
+			if (ret < 0) {
+				return ret;
+			}
+			continue;
+		}
+
+		// As in the session write backs, the writes already extended the file if it grew
+		if (ret == 0 && entry->size < i_size_read(_fileInode(filePtr))) {
+			ret = journalOps->truncate(filePtr, entry->size);
+		}
+		// The record can leave the journal only once the file holds it on the disk
+		if (ret == 0) {
+			ret = vfs_fsync(filePtr, 0);
+		}
+		if (files == NULL) {
+			filp_close(filePtr, NULL);
+		}
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Frees the transaction, dropping the files it held
+ */
+static void _txnFree(sessionJournalTxn *txn) {
+	int i;
+
+	for (i = 0; i < txn->fileCount; i++) {
+		fput(txn->files[i]);
+	}
+	kfree(txn->files);
+	vfree(txn->record);
+	kfree(txn);
+}
+
+/*
+ * Records on the disk that the records up to seq have been applied, and that the replay starts from head.
+ * The room of the records applied can be reused only once their checkpoint is on the disk
+ * Returns 0 on success, or a negative error
+ */
+static int _journalCheckpoint(u64 seq, loff_t head) {
+	struct journalCheckpoint checkpoint;
+	int ret;
+
+	checkpoint.magic = JOURNAL_CHECKPOINT_MAGIC;
+	checkpoint.crc = 0;
+	checkpoint.seq = seq;
+	checkpoint.head = head;
+	checkpoint.crc = crc32_le(~0, (const unsigned char*) &checkpoint,
+			sizeof(checkpoint));
+
+	ret = _journalWrite(journalFilePtr, (const char*) &checkpoint,
+			sizeof(checkpoint), (checkpointCount & 1) * JOURNAL_SLOT_SIZE);
+	if (ret == 0) {
+		ret = vfs_fsync(journalFilePtr, 1);
+	}
+	// A failed checkpoint is written again in the same slot, the other one still holds the previous checkpoint
+	if (ret == 0) {
+		checkpointCount++;
+	}
+	return ret;
+}
+
+/*
+ * Reads the latest whole checkpoint of the journal, a journal without any is replayed from its first record
+ * @seq: filled with the sequence number of the last record applied
+ * @head: filled with the offset the replay starts from
+ */
+static void _journalLoadCheckpoint(u64 *seq, loff_t *head) {
+	struct journalCheckpoint checkpoint;
+	u32 crc;
+	int slot;
+
+	*seq = 0;
+	*head = JOURNAL_START;
+
+	for (slot = 0; slot < 2; slot++) {
+		if (_journalRead(journalFilePtr, (char*) &checkpoint, sizeof(checkpoint),
+				slot * JOURNAL_SLOT_SIZE) < 0
+				|| checkpoint.magic != JOURNAL_CHECKPOINT_MAGIC) {
+			continue;
+		}
+		crc = checkpoint.crc;
+		checkpoint.crc = 0;
+		if (crc != crc32_le(~0, (const unsigned char*) &checkpoint,
+						sizeof(checkpoint)) || checkpoint.seq < *seq) {
+			continue;
+		}
+		*seq = checkpoint.seq;
+		*head = checkpoint.head;
+		// The next checkpoint goes in the other slot, keeping this one whole
+		checkpointCount = slot + 1;
+	}
+}
+
+/*
+ * Applies a transaction appended to the journal, in append order, and checkpoints it. A record that can't be
+ * applied stays pending, as the following ones, so that the write backs and the opens of their files fail
+ * instead of missing it. The following commits fail too, until the module is loaded again and replays them
+ */
+static void _journalApplyWork(struct work_struct *work) {
+	sessionJournalTxn *txn = container_of(work, sessionJournalTxn, work);
+	int ret = -EIO;
+
+	// The records after a failed one must not be applied before it
+	if (!journalBroken) {
+		ret = _journalApplyRecord(txn->record, txn->used, txn->files);
+		if (ret == 0) {
+			ret = _journalCheckpoint(txn->seq, txn->end);
+		}
+		if (ret < 0) {
+			printk(KERN_ERR "Can't apply a journaled session write back %d, kept in the journal\n", ret);
+			journalBroken = 1;
+		}
+	}
+
+	spin_lock(&pendingLock);
+	if (ret < 0) {
+		txn->failed = 1;
+	} else {
+		list_del(&txn->pendingList);
+	}
+	spin_unlock(&pendingLock);
+	wake_up_all(&appliedQueue);
+
+	if (ret == 0) {
+		_txnFree(txn);
+	}
+}
+
+/*
+ * Reserves length bytes at the end of the record, growing it if needed
+ * Returns 0 on success and the offset of the bytes in offset, or a negative error
+ */
+static int _txnReserve(sessionJournalTxn *txn, size_t length, size_t *offset) {
+	size_t size = txn->size;
+	char *record;
+
+	if (txn->used + length > JOURNAL_MAX_RECORD) {
+		return -EFBIG;
+	}
+
+	while (txn->used + length > size) {
+		size <<= 1;
+	}
+	if (size != txn->size) {
+		record = (char*) vmalloc(size);
+		if (record == NULL ) {
+			return -ENOMEM;
+		}
+		memcpy(record, txn->record, txn->used);
+		vfree(txn->record);
+		txn->record = record;
+		txn->size = size;
+	}
+
+	*offset = txn->used;
+	txn->used += length;
+	return 0;
+}
+
+/*
+ * Begins a transaction, gathering the write backs appended to the journal as a whole
+ * Returns the transaction, or NULL if it can't be allocated
+ */
+sessionJournalTxn* sessionJournalBegin(void) {
+	sessionJournalTxn *txn;
+
+	txn = (sessionJournalTxn*) kzalloc(sizeof(sessionJournalTxn), GFP_KERNEL);
+	if (txn == NULL ) {
+		return NULL;
+	}
+
+	txn->record = (char*) vmalloc(JOURNAL_INITIAL_SIZE);
+	if (txn->record == NULL ) {
+		kfree(txn);
+		return NULL;
+	}
+	txn->size = JOURNAL_INITIAL_SIZE;
+	txn->used = sizeof(struct journalHeader);
+	INIT_LIST_HEAD(&txn->pendingList);
+	INIT_WORK(&txn->work, _journalApplyWork);
+	return txn;
+}
+
+/*
+ * Adds a file to the transaction, the following extents are written in it. The transaction takes over the
+ * reference to the file, even on failure, and writes the file through it. On failure the transaction can
+ * only be aborted
+ * @txn: the transaction
+ * @filePtr: the file, opened for writing with the original file operations
+ * @size: size of the file once written
+ */
+int sessionJournalAddFile(sessionJournalTxn *txn, struct file *filePtr,
+		loff_t size) {
+	struct journalFile *entry;
+	struct file **files;
+	char *pathBuffer;
+	char *path;
+	size_t pathLength;
+	size_t offset;
+	int ret;
+
+	if (txn->fileCount == txn->fileSlots) {
+		files = (struct file**) krealloc(txn->files,
+				(txn->fileSlots + 4) * sizeof(struct file*), GFP_KERNEL);
+		if (files == NULL ) {
+			fput(filePtr);
+			return -ENOMEM;
+		}
+		txn->files = files;
+		txn->fileSlots += 4;
+	}
+	txn->files[txn->fileCount++] = filePtr;
+
+	// The replay after a crash finds the file by path
+	pathBuffer = (char*) __get_free_page(GFP_KERNEL);
+	if (pathBuffer == NULL ) {
+		return -ENOMEM;
+	}
+	path = d_path(&filePtr->f_path, pathBuffer, PAGE_SIZE);
+	if (IS_ERR(path)) {
+		ret = PTR_ERR(path);
+		goto out;
+	}
+	pathLength = strlen(path);
+
+	ret = _txnReserve(txn, sizeof(struct journalFile) + _journalAlign(pathLength),
+			&offset);
+	if (ret < 0) {
+		goto out;
+	}
+	entry = (struct journalFile*) &txn->record[offset];
+	entry->size = size;
+	entry->pathLength = pathLength;
+	entry->extents = 0;
+	memcpy(&entry[1], path, pathLength);
+	memset((char*) &entry[1] + pathLength, 0,
+			_journalAlign(pathLength) - pathLength);
+	txn->fileOffset = offset;
+
+out:
+	free_page((unsigned long) pathBuffer);
+	return ret;
+}
+
+/*
+ * Adds an extent to the last file added to the transaction, copying its contents
+ * @txn: the transaction
+ * @data: contents of the extent
+ * @offset: offset of the extent in the file
+ * @length: bytes of the extent
+ */
+int sessionJournalAddExtent(sessionJournalTxn *txn, const char *data,
+		loff_t offset, size_t length) {
+	struct journalExtent *extent;
+	size_t recordOffset;
+	int ret;
+
+	ret = _txnReserve(txn, sizeof(struct journalExtent) + _journalAlign(length),
+			&recordOffset);
+	if (ret < 0) {
+		return ret;
+	}
+	extent = (struct journalExtent*) &txn->record[recordOffset];
+	extent->offset = offset;
+	extent->length = length;
+	memcpy(&extent[1], data, length);
+	memset((char*) &extent[1] + length, 0, _journalAlign(length) - length);
+
+	((struct journalFile*) &txn->record[txn->fileOffset])->extents++;
+	return 0;
+}
+
+/*
+ * Finds room for a record of length bytes after the tail, or from the start of the journal when it does not
+ * fit before journalMaxSize, without reaching the oldest record not applied yet. Called with journalLock held
+ * Returns the offset of the record, or -1 if there is no room until more records are applied
+ */
+static loff_t _journalPlace(size_t length) {
+	loff_t head = -1;
+
+	spin_lock(&pendingLock);
+	if (!list_empty(&pendingTxns)) {
+		head = list_first_entry(&pendingTxns, sessionJournalTxn, pendingList)->start;
+	}
+	spin_unlock(&pendingLock);
+
+	// The records to keep, if any, lie before the tail: the room goes up to the end of the journal, then
+	// from its start up to the first record to keep
+	if (head < 0 || head < journalTail) {
+		if (journalTail + length <= journalMaxSize) {
+			return journalTail;
+		}
+		return (head < 0 || JOURNAL_START + length <= head) ? JOURNAL_START : -1;
+	}
+
+	// The tail wrapped around, the room goes up to the first record to keep
+	return journalTail + length <= head ? journalTail : -1;
+}
+
+/*
+ * Appends the transaction to the journal followed by its commit record, and flushes the journal to the disk.
+ * The transaction is then applied in the background and freed, the caller must not use it anymore.
+ * Returns 0 once the transaction is on the disk, or a negative error if nothing has been committed
+ */
+int sessionJournalCommit(sessionJournalTxn *txn) {
+	struct journalHeader *header = (struct journalHeader*) txn->record;
+	struct journalCommit commit;
+	size_t length = txn->used + sizeof(commit);
+	u32 wiped = 0;
+	loff_t pos = -1;
+	int ret;
+
+	if (length > journalMaxSize - JOURNAL_START) {
+		_txnFree(txn);
+		return -EFBIG;
+	}
+
+	mutex_lock(&journalLock);
+	// Waits for the records before it to make room, the following appends wait on journalLock meanwhile
+	wait_event(appliedQueue, journalBroken || (pos = _journalPlace(length)) >= 0);
+	if (journalBroken) {
+		ret = -EIO;
+		goto fail;
+	}
+
+	header->magic = JOURNAL_MAGIC;
+	header->files = txn->fileCount;
+	header->seq = journalSeq + 1;
+	header->length = txn->used;
+	commit.magic = JOURNAL_COMMIT_MAGIC;
+	commit.crc = crc32_le(~0, (const unsigned char*) txn->record, txn->used);
+	commit.seq = header->seq;
+
+	ret = _journalWrite(journalFilePtr, txn->record, txn->used, pos);
+	if (ret == 0) {
+		ret = _journalWrite(journalFilePtr, (const char*) &commit,
+				sizeof(commit), pos + txn->used);
+	}
+	if (ret == 0) {
+		ret = vfs_fsync(journalFilePtr, 1);
+	}
+	if (ret < 0) {
+		// The record may reach the disk whole anyway, and the replay would apply it: its header is wiped out
+		if (_journalWrite(journalFilePtr, (const char*) &wiped, sizeof(wiped),
+				pos) < 0 || vfs_fsync(journalFilePtr, 1) < 0) {
+			journalBroken = 1;
+		}
+		goto fail;
+	}
+	journalSeq++;
+	journalTail = pos + length;
+	txn->seq = journalSeq;
+	txn->start = pos;
+	txn->end = journalTail;
+
+	spin_lock(&pendingLock);
+	list_add_tail(&txn->pendingList, &pendingTxns);
+	spin_unlock(&pendingLock);
+	queue_work(applyQueue, &txn->work);
+
+	mutex_unlock(&journalLock);
+	return 0;
+
+fail:
+	mutex_unlock(&journalLock);
+	_txnFree(txn);
+	return ret;
+}
+
+/*
+ * Writes the files as the transaction says right away, without appending it to the journal, and frees it.
+ * The group commits without a journal write back through it the contents they overwrote before a failure
+ * Returns 0 on success, or a negative error
+ */
+int sessionJournalApply(sessionJournalTxn *txn) {
+	int ret;
+
+	((struct journalHeader*) txn->record)->files = txn->fileCount;
+	ret = _journalApplyRecord(txn->record, txn->used, txn->files);
+	_txnFree(txn);
+	return ret;
+}
+
+/*
+ * Drops a transaction without committing it
+ */
+void sessionJournalAbort(sessionJournalTxn *txn) {
+	_txnFree(txn);
+}
+
+/*
+ * Returns 1 if a transaction writing the inode has not been applied yet, -EIO if it could not be applied,
+ * or 0 if the file holds every write back journaled
+ */
+static int _journalPendingOn(struct inode *inode) {
+	sessionJournalTxn *txn;
+	int pending = 0;
+	int i;
+
+	spin_lock(&pendingLock);
+	list_for_each_entry(txn, &pendingTxns, pendingList) {
+		for (i = 0; i < txn->fileCount; i++) {
+			if (_fileInode(txn->files[i]) == inode) {
+				pending = txn->failed ? -EIO : 1;
+				goto out;
+			}
+		}
+	}
+out:
+	spin_unlock(&pendingLock);
+	return pending;
+}
+
+/*
+ * Waits until the write backs of the inode committed to the journal have been applied, so that the file
+ * holds them. Does nothing if the journal is not in use
+ * Returns 0 once the file holds them, or -EIO if one of them could not be applied: the file misses it until
+ * the module is loaded again and replays the journal
+ */
+int sessionJournalSync(struct inode *inode) {
+	int pending;
+
+	if (!sessionJournalEnabled) {
+		return 0;
+	}
+
+	wait_event(appliedQueue, (pending = _journalPendingOn(inode)) <= 0);
+	return pending;
+}
+
+/*
+ * Keeps pending as failed a record the replay can't apply, so that opening a session on its files and writing
+ * them back fail until the module is loaded again and replays it. The files are opened by path, those gone
+ * meanwhile are skipped, and the record itself stays in the journal
+ * Returns 0 on success, or a negative error
+ * @record: the record, header included
+ * @length: bytes of the record
+ */
+static int _journalPendFailed(const char *record, size_t length) {
+	const struct journalHeader *header = (const struct journalHeader*) record;
+	const struct journalFile *entry;
+	const struct journalExtent *extent;
+	sessionJournalTxn *txn;
+	size_t offset = sizeof(struct journalHeader);
+	struct file *filePtr;
+	char *path;
+	u32 file;
+	u32 i;
+
+	txn = (sessionJournalTxn*) kzalloc(sizeof(sessionJournalTxn), GFP_KERNEL);
+	if (txn == NULL ) {
+		return -ENOMEM;
+	}
+	txn->files = (struct file**) kcalloc(header->files, sizeof(struct file*),
+			GFP_KERNEL);
+	if (txn->files == NULL ) {
+		kfree(txn);
+		return -ENOMEM;
+	}
+	txn->fileSlots = header->files;
+
+	for (file = 0; file < header->files; file++) {
+		entry = (const struct journalFile*) &record[offset];
+		if (offset + sizeof(struct journalFile) > length
+				|| offset + sizeof(struct journalFile)
+						+ _journalAlign(entry->pathLength) > length) {
+			break;
+		}
+		offset += sizeof(struct journalFile) + _journalAlign(entry->pathLength);
+
+		path = kstrndup((const char*) &entry[1], entry->pathLength, GFP_KERNEL);
+		if (path == NULL ) {
+			_txnFree(txn);
+			return -ENOMEM;
+		}
+		filePtr = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+		kfree(path);
+		if (!IS_ERR(filePtr)) {
+			txn->files[txn->fileCount++] = filePtr;
+		}
+
+		for (i = 0; i < entry->extents; i++) {
+			extent = (const struct journalExtent*) &record[offset];
+			if (offset + sizeof(struct journalExtent) > length) {
+				break;
+			}
+			offset += sizeof(struct journalExtent) + _journalAlign(extent->length);
+		}
+	}
+
+	txn->failed = 1;
+	spin_lock(&pendingLock);
+	list_add_tail(&txn->pendingList, &pendingTxns);
+	spin_unlock(&pendingLock);
+	return 0;
+}
+
+/*
+ * Frees the transactions still pending, the ones that could not be applied are left in the journal, past
+ * the checkpoint
+ */
+static void _journalDropPending(void) {
+	sessionJournalTxn *txn;
+	sessionJournalTxn *next;
+
+	list_for_each_entry_safe(txn, next, &pendingTxns, pendingList) {
+		list_del(&txn->pendingList);
+		_txnFree(txn);
+	}
+}
+
+/*
+ * Reads the record of sequence number seq at pos, checking it against its commit record
+ * Returns the bytes of the record, allocated in record, 0 if pos holds no such record committed, or a
+ * negative error
+ */
+static long _journalReadRecord(loff_t pos, u64 seq, char **record) {
+	struct journalHeader header;
+	struct journalCommit commit;
+	loff_t size = i_size_read(_fileInode(journalFilePtr));
+
+	if (pos + sizeof(header) + sizeof(commit) > size
+			|| _journalRead(journalFilePtr, (char*) &header, sizeof(header), pos) < 0
+			|| header.magic != JOURNAL_MAGIC
+			|| header.seq != seq
+			|| header.length < sizeof(header)
+			|| header.length > JOURNAL_MAX_RECORD
+			|| pos + header.length + sizeof(commit) > size) {
+		return 0;
+	}
+
+	*record = (char*) vmalloc(header.length);
+	if (*record == NULL ) {
+		return -ENOMEM;
+	}
+	if (_journalRead(journalFilePtr, *record, header.length, pos) < 0
+			|| _journalRead(journalFilePtr, (char*) &commit, sizeof(commit),
+					pos + header.length) < 0
+			|| commit.magic != JOURNAL_COMMIT_MAGIC
+			|| commit.seq != seq
+			|| commit.crc
+					!= crc32_le(~0, (const unsigned char*) *record,
+							header.length)) {
+		vfree(*record);
+		return 0;
+	}
+
+	return header.length;
+}
+
+/*
+ * Applies the records committed to the journal past its checkpoint, in sequence order. Each record follows
+ * the previous one, or starts the journal if it wrapped around. The replay stops at the first record missing,
+ * which has been torn by a crash or never committed, and checkpoints the records applied. A record that
+ * can't be applied breaks the journal: it stays past the checkpoint with the following ones, which are not
+ * applied before it, and they are all kept pending as failed
+ * Returns 0 on success, even if the journal broke, or a negative error
+ */
+static int _journalReplay(void) {
+	loff_t pos;
+	loff_t appliedPos;
+	u64 seq;
+	u64 appliedSeq;
+	char *record;
+	long length;
+	int records = 0;
+	int ret = 0;
+
+	_journalLoadCheckpoint(&seq, &pos);
+	appliedSeq = seq;
+	appliedPos = pos;
+
+	for (;;) {
+		length = _journalReadRecord(pos, seq + 1, &record);
+		if (length == 0 && pos != JOURNAL_START) {
+			length = _journalReadRecord(JOURNAL_START, seq + 1, &record);
+			if (length > 0) {
+				pos = JOURNAL_START;
+			}
+		}
+		if (length < 0) {
+			return length;
+		}
+		if (length == 0) {
+			break;
+		}
+
+		if (!journalBroken) {
+			ret = _journalApplyRecord(record, length, NULL);
+			if (ret < 0) {
+				printk(KERN_ERR "Can't replay a session write back %d, kept in the journal\n", ret);
+				journalBroken = 1;
+			}
+		}
+		if (journalBroken) {
+			ret = _journalPendFailed(record, length);
+		}
+		vfree(record);
+		if (ret < 0) {
+			return ret;
+		}
+		seq++;
+		pos += length + sizeof(struct journalCommit);
+		if (!journalBroken) {
+			records++;
+			appliedSeq = seq;
+			appliedPos = pos;
+		}
+	}
+
+	// The appends go on from the last record, they fail anyway while the journal is broken
+	journalSeq = seq;
+	journalTail = pos;
+	if (records == 0) {
+		return 0;
+	}
+
+	printk(KERN_INFO "Replayed %d session write backs from the journal\n", records);
+	return _journalCheckpoint(appliedSeq, appliedPos);
+}
+
+/*
+ * Opens the journal named by journalPath and replays it, before any session can copy in the files it
+ * writes. Does nothing if journalPath is empty. A record that can't be applied does not fail the load:
+ * the journal is used broken, the files of the records left fail with -EIO and the commits too
+ * Returns 0 on success, or a negative error if the journal can't be used
+ * @ops: file accessors of the session module
+ */
+int sessionJournalInit(const struct sessionJournalOps *ops) {
+	int ret;
+
+	// The transactions applied right away need the accessors even without a journal
+	journalOps = ops;
+	if (journalPath == NULL || journalPath[0] == '\0') {
+		return 0;
+	}
+
+	if (journalMaxSize < JOURNAL_START + JOURNAL_INITIAL_SIZE) {
+		printk(KERN_ERR "Session journal too small, at least %d bytes\n",
+				JOURNAL_START + JOURNAL_INITIAL_SIZE);
+		return -EINVAL;
+	}
+
+	journalFilePtr = filp_open(journalPath, O_RDWR | O_CREAT | O_LARGEFILE,
+			S_IRUSR | S_IWUSR);
+	if (IS_ERR(journalFilePtr)) {
+		printk(KERN_ERR "Can't open the session journal %s\n", journalPath);
+		ret = PTR_ERR(journalFilePtr);
+		journalFilePtr = NULL;
+		return ret;
+	}
+
+	ret = _journalReplay();
+	if (ret < 0) {
+		printk(KERN_ERR "Can't replay the session journal %d\n", ret);
+		goto fail;
+	}
+	if (journalBroken) {
+		printk(KERN_ERR "Session journal broken, its files and the write backs fail until the next load\n");
+	}
+
+	applyQueue = alloc_ordered_workqueue("sessionJournal", WQ_MEM_RECLAIM);
+	if (applyQueue == NULL ) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	sessionJournalEnabled = 1;
+	return 0;
+
+fail:
+	_journalDropPending();
+	journalBroken = 0;
+	filp_close(journalFilePtr, NULL);
+	journalFilePtr = NULL;
+	return ret;
+}
+
+/*
+ * Applies the transactions still pending and closes the journal, called once no session exists anymore
+ */
+void sessionJournalExit(void) {
+	if (!sessionJournalEnabled) {
+		return;
+	}
+
+	sessionJournalEnabled = 0;
+	destroy_workqueue(applyQueue);
+	applyQueue = NULL;
+
+	_journalDropPending();
+	filp_close(journalFilePtr, NULL);
+	journalFilePtr = NULL;
+}
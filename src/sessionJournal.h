@@ -0,0 +1,44 @@
+/*
+ ============================================================================
+ Name        : sessionJournal.h
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Declaration of the session write ahead journal
+ ============================================================================
+ */
+
+#ifndef SESSIONJOURNAL_H_
+#define SESSIONJOURNAL_H_
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+// Write back of one or more sessions, appended to the journal as a whole
+typedef struct sessionJournalTxn_struct sessionJournalTxn;
+
+// File accessors of the session module, whose kernel counterparts are not exported on every kernel
+struct sessionJournalOps {
+	ssize_t (*read)(struct file *filePtr, char *buffer, size_t count,
+			loff_t pos);
+	ssize_t (*write)(struct file *filePtr, const char *buffer, size_t count,
+			loff_t pos);
+	int (*truncate)(struct file *filePtr, loff_t length);
+};
+
+extern int sessionJournalEnabled;
+
+int sessionJournalInit(const struct sessionJournalOps *ops);
+void sessionJournalExit(void);
+sessionJournalTxn* sessionJournalBegin(void);
+int sessionJournalAddFile(sessionJournalTxn *txn, struct file *filePtr,
+		loff_t size);
+int sessionJournalAddExtent(sessionJournalTxn *txn, const char *data,
+		loff_t offset, size_t length);
+int sessionJournalCommit(sessionJournalTxn *txn);
+int sessionJournalApply(sessionJournalTxn *txn);
+void sessionJournalAbort(sessionJournalTxn *txn);
+int sessionJournalSync(struct inode *inode);
+
+#endif /* SESSIONJOURNAL_H_ */
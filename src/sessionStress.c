@@ -0,0 +1,350 @@
+/*
+ ============================================================================
+ Name        : sessionStress.c
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Companion module stressing the session file operations from
+ 	 kernel threads pinned to distinct CPUs, without any syscall overhead.
+ 	 Writing to /sys/kernel/debug/sessionstress/run starts a run with the
+ 	 current parameters, /sys/kernel/debug/sessionstress/results reports
+ 	 the throughput of each thread and the time it waited on each lock
+ ============================================================================
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/debugfs.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/cpumask.h>
+#include <linux/delay.h>
+#include <linux/uio.h>
+#include <asm/uaccess.h>
+
+#include "Defines.h"
+#include "sessionFileOperations.h"
+
+MODULE_LICENSE("GPL");
+
+#define MAX_THREADS 256 // Maximum number of stress threads
+#define MAX_IOSIZE 4096 // Maximum size of a single read or write
+#define REPORT_SIZE (128 * (MAX_THREADS + 2)) // Size of the results report
+
+static char *path = "/tmp/sessionstress";
+static int threads = 4;
+static int sessions = 1;
+static int readPercent = 70;
+static int writePercent = 20;
+static int ioSize = 512;
+static int durationMs = 1000;
+
+module_param(path, charp, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(path, "Test file, it must exist and fit in a session buffer");
+module_param(threads, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(threads, "Number of threads, each pinned to its own CPU while there are enough");
+module_param(sessions, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(sessions, "Number of sessions opened on the test file, shared round robin by the threads");
+module_param(readPercent, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(readPercent, "Percentage of reads in the operation mix");
+module_param(writePercent, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(writePercent, "Percentage of writes in the operation mix, the rest are llseeks");
+module_param(ioSize, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(ioSize, "Size of each read and write");
+module_param(durationMs, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(durationMs, "Duration of a run in milliseconds");
+
+struct stressThread_struct {
+	struct task_struct *task; // The kthread
+	struct file *filePtr; // Session used by the thread
+	int cpu; // CPU the thread is pinned to
+	unsigned int seed; // State of the thread random generator
+	unsigned long reads; // Completed reads
+	unsigned long writes; // Completed writes
+	unsigned long seeks; // Completed llseeks
+	unsigned long errors; // Failed operations
+	struct sessionLockStat lockStat; // Lock waits of the CPU of the thread
+};
+
+typedef struct stressThread_struct stressThread;
+
+static stressThread *stressThreads = NULL;
+static int stressThreadNum = 0;
+static unsigned long stressElapsedMs = 0;
+static atomic_t stressStart = ATOMIC_INIT(0);
+static DEFINE_MUTEX(stressLock);
+static struct dentry *stressDir = NULL;
+
+/*
+ * Xorshift generator, cheap and private to each thread
+ */
+static inline unsigned int _stressRandom(stressThread *thread) {
+	thread->seed ^= thread->seed << 13;
+	thread->seed ^= thread->seed >> 17;
+	thread->seed ^= thread->seed << 5;
+	return thread->seed;
+}
+
+/*
+ * Reads or writes count bytes of the session at pos from a kernel buffer
+ */
+static ssize_t _stressIo(struct file *filePtr, char *buffer, size_t count,
+		loff_t *pos, int write) {
+#ifdef SESSION_HAVE_ITER
+	struct kiocb iocb;
+	struct iov_iter iter;
+	struct kvec kvec = { iov_base : buffer, iov_len : count };
+	ssize_t ret;
+
+	init_sync_kiocb(&iocb, filePtr);
+	iocb.ki_pos = *pos;
+	iov_iter_kvec(&iter, write ? WRITE : READ, &kvec, 1, count);
+	ret = write ? sessionWriteIter(&iocb, &iter) : sessionReadIter(&iocb, &iter);
+	*pos = iocb.ki_pos;
+	return ret;
+#else
+	// The cast to a user pointer is valid due to the set_fs() done by the thread
+	if (write) {
+		return sessionWrite(filePtr, (const char __user *) buffer, count, pos);
+	}
+	return sessionRead(filePtr, (char __user *) buffer, count, pos);
+#endif
+}
+
+/*
+ * Body of a stress thread: waits for the start, then issues the configured mix until it is stopped
+ */
+static int _stressThreadFn(void *data) {
+	stressThread *thread = (stressThread*) data;
+	char *buffer;
+	loff_t pos;
+	loff_t size;
+	unsigned int dice;
+	ssize_t ret;
+#ifndef SESSION_HAVE_ITER
+	mm_segment_t oldfs;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+#endif
+
+	buffer = kzalloc(ioSize, GFP_KERNEL);
+
+	// All the threads start together
+	while (!atomic_read(&stressStart) && !kthread_should_stop()) {
+		cond_resched();
+	}
+
+	while (buffer != NULL && !kthread_should_stop()) {
+		size = sessionLlseek(thread->filePtr, 0, SEEK_END);
+		if (size <= ioSize) {
+			size = ioSize + 1;
+		}
+		pos = _stressRandom(thread) % (unsigned int) (size - ioSize);
+		dice = _stressRandom(thread) % 100;
+
+		if (dice < readPercent) {
+			ret = _stressIo(thread->filePtr, buffer, ioSize, &pos, 0);
+			thread->reads++;
+		} else if (dice < readPercent + writePercent) {
+			ret = _stressIo(thread->filePtr, buffer, ioSize, &pos, 1);
+			thread->writes++;
+		} else {
+			ret = sessionLlseek(thread->filePtr, pos, SEEK_SET);
+			thread->seeks++;
+		}
+		if (ret < 0) {
+			thread->errors++;
+		}
+
+		cond_resched();
+	}
+
+	kfree(buffer);
+#ifndef SESSION_HAVE_ITER
+	set_fs(oldfs);
+#endif
+
+	// Wait for kthread_stop, the run function still references the task
+	while (!kthread_should_stop()) {
+		schedule_timeout_interruptible(1);
+	}
+	return 0;
+}
+
+/*
+ * Performs a run: opens the sessions, runs the threads for durationMs, and collects their results
+ */
+static int _stressRun(void) {
+	struct file **filePtrs;
+	unsigned long start;
+	int cpu;
+	int i;
+	int ret = 0;
+
+	if (threads <= 0 || threads > MAX_THREADS || sessions <= 0
+			|| sessions > threads || ioSize <= 0 || ioSize > MAX_IOSIZE
+			|| readPercent < 0 || writePercent < 0
+			|| readPercent + writePercent > 100) {
+		return -EINVAL;
+	}
+
+	filePtrs = kzalloc(sessions * sizeof(struct file *), GFP_KERNEL);
+	kfree(stressThreads);
+	stressThreadNum = 0;
+	stressThreads = kzalloc(threads * sizeof(stressThread), GFP_KERNEL);
+	if (filePtrs == NULL || stressThreads == NULL ) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < sessions; i++) {
+		filePtrs[i] = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+		if (IS_ERR(filePtrs[i])) {
+			ret = PTR_ERR(filePtrs[i]);
+			filePtrs[i] = NULL;
+			goto out;
+		}
+		ret = sessionOpen(filePtrs[i], O_SESSION, 0);
+		if (ret < 0) {
+			goto out;
+		}
+	}
+
+	// One thread per CPU, wrapping around when there are more threads than CPUs
+	atomic_set(&stressStart, 0);
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < threads; i++) {
+		stressThreads[i].filePtr = filePtrs[i % sessions];
+		stressThreads[i].cpu = cpu;
+		stressThreads[i].seed = 2463534242U + i;
+		stressThreads[i].task = kthread_create(_stressThreadFn,
+				&stressThreads[i], "sessionstress/%d", i);
+		if (IS_ERR(stressThreads[i].task)) {
+			ret = PTR_ERR(stressThreads[i].task);
+			stressThreads[i].task = NULL;
+			break;
+		}
+		kthread_bind(stressThreads[i].task, cpu);
+		wake_up_process(stressThreads[i].task);
+		stressThreadNum++;
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids) {
+			cpu = cpumask_first(cpu_online_mask);
+		}
+	}
+
+	sessionLockStatEnable(1);
+	start = jiffies;
+	atomic_set(&stressStart, 1);
+
+	if (ret == 0) {
+		msleep(durationMs);
+	}
+
+	for (i = 0; i < stressThreadNum; i++) {
+		kthread_stop(stressThreads[i].task);
+	}
+	stressElapsedMs = jiffies_to_msecs(jiffies - start);
+
+	// Threads are pinned, hence the lock waits of their CPU are theirs while there are enough CPUs
+	for (i = 0; i < stressThreadNum; i++) {
+		sessionLockStatRead(stressThreads[i].cpu, &stressThreads[i].lockStat);
+	}
+	sessionLockStatEnable(0);
+
+out:
+	// Closing the files tears the sessions down
+	for (i = 0; filePtrs != NULL && i < sessions; i++) {
+		if (filePtrs[i] != NULL ) {
+			filp_close(filePtrs[i], NULL );
+		}
+	}
+	kfree(filePtrs);
+	return ret;
+}
+
+/*
+ * Any write to the run file starts a run, the write returns when the run is over
+ */
+static ssize_t _stressRunWrite(struct file *filePtr, const char __user *buff,
+		size_t count, loff_t *pos) {
+	int ret;
+
+	mutex_lock(&stressLock);
+	ret = _stressRun();
+	mutex_unlock(&stressLock);
+
+	return ret < 0 ? ret : count;
+}
+
+/*
+ * Reports the results of the last run
+ */
+static ssize_t _stressResultsRead(struct file *filePtr, char __user *buff,
+		size_t count, loff_t *pos) {
+	char *report;
+	unsigned long ops;
+	int length;
+	int i;
+	ssize_t ret;
+
+	report = kmalloc(REPORT_SIZE, GFP_KERNEL);
+	if (report == NULL ) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&stressLock);
+	length = scnprintf(report, REPORT_SIZE,
+			"# %d threads, %lu ms\n# thread cpu reads writes seeks errors ops/s usageWait(ns) fileInBufferLockWait(ns) writeLockWait(ns)\n",
+			stressThreadNum, stressElapsedMs);
+	for (i = 0; i < stressThreadNum; i++) {
+		ops = stressThreads[i].reads + stressThreads[i].writes
+				+ stressThreads[i].seeks;
+		length += scnprintf(&report[length], REPORT_SIZE - length,
+				"%d %d %lu %lu %lu %lu %lu %llu %llu %llu\n", i,
+				stressThreads[i].cpu, stressThreads[i].reads,
+				stressThreads[i].writes, stressThreads[i].seeks,
+				stressThreads[i].errors,
+				stressElapsedMs ? ops * 1000 / stressElapsedMs : 0,
+				stressThreads[i].lockStat.usageWait,
+				stressThreads[i].lockStat.fileInBufferLockWait,
+				stressThreads[i].lockStat.writeLockWait);
+	}
+	mutex_unlock(&stressLock);
+
+	ret = simple_read_from_buffer(buff, count, pos, report, length);
+	kfree(report);
+	return ret;
+}
+
+static const struct file_operations stressRunFops = { owner : THIS_MODULE, write
+		: _stressRunWrite, };
+
+static const struct file_operations stressResultsFops = { owner : THIS_MODULE, read
+		: _stressResultsRead, };
+
+static int __init init_sessionStress(void) {
+	stressDir = debugfs_create_dir("sessionstress", NULL);
+	if (IS_ERR_OR_NULL(stressDir)) {
+		printk(KERN_ERR "Cannot create the sessionstress debugfs directory\n");
+		return -ENODEV;
+	}
+
+	debugfs_create_file("run", S_IWUSR, stressDir, NULL, &stressRunFops);
+	debugfs_create_file("results", S_IRUSR, stressDir, NULL, &stressResultsFops);
+	return 0;
+}
+
+static void __exit cleanup_sessionStress(void) {
+	debugfs_remove_recursive(stressDir);
+	kfree(stressThreads);
+}
+
+module_init(init_sessionStress);
+module_exit(cleanup_sessionStress);
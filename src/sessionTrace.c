@@ -0,0 +1,312 @@
+/*
+ ============================================================================
+ Name        : sessionTrace.c
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Capture of the session operations in per CPU rings of compact
+ 	 events. Writing 1 to /sys/kernel/debug/session/traceEnable starts the
+ 	 capture and 0 stops it, reading /sys/kernel/debug/session/trace drains
+ 	 the captured events, /sys/kernel/debug/session/traceLost reports the
+ 	 events dropped because a ring was full
+ ============================================================================
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <asm/uaccess.h>
+
+#include "Defines.h"
+#include "sessionCompat.h"
+#include "sessionTrace.h"
+
+#define DEFAULT_TRACEEVENTS 8192 // Default number of events kept per CPU
+#define DRAIN_CHUNK 64 // Events drained from a ring under its lock at a time
+
+struct sessionTraceRing_struct {
+	spinlock_t lock; // Lock against the drain
+	struct sessionTraceEvent *events; // Captured events
+	unsigned long head; // Next event to drain
+	unsigned long tail; // Next free event
+	unsigned long lost; // Events dropped because the ring was full
+};
+
+typedef struct sessionTraceRing_struct sessionTraceRing;
+
+// Set while the capture is running
+int sessionTraceEnabled = 0;
+
+static sessionTraceRing *rings = NULL; // One ring per possible CPU
+static int ringEvents = DEFAULT_TRACEEVENTS; // Events per ring
+module_param_named(traceEvents, ringEvents, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(traceEvents, "Number of session events captured per CPU before dropping them");
+static int ringsAllocated = 0; // Set once the rings have been allocated, they are freed on exit only
+static atomic64_t nextSessionId = ATOMIC64_INIT(0);
+static DEFINE_MUTEX(traceLock); // Serializes the enables and the drains
+static struct dentry *traceDir = NULL;
+
+/*
+ * Returns a new session identifier, never reused
+ */
+u64 sessionTraceNewId(void) {
+	return atomic64_inc_return(&nextSessionId);
+}
+
+/*
+ * Records an event in the ring of the calling CPU, or drops it if the ring is full
+ * @type: SESSION_TRACE_* event type
+ * @session: identifier of the session
+ * @offset: offset of the operation
+ * @size: size of the operation
+ * @mode: open mode
+ */
+void sessionTraceRecord(int type, u64 session, loff_t offset,
+		unsigned int size, unsigned int mode) {
+	sessionTraceRing *ring;
+	struct sessionTraceEvent *event;
+	int cpu;
+
+	cpu = get_cpu();
+	ring = &rings[cpu];
+
+	spin_lock(&ring->lock);
+	if (ring->tail - ring->head == ringEvents) {
+		ring->lost++;
+	} else {
+		event = &ring->events[ring->tail % ringEvents];
+		event->timestamp = local_clock();
+		event->session = session;
+		event->offset = offset;
+		event->size = size;
+		event->mode = mode;
+		event->pid = current->pid;
+		event->type = type;
+		event->cpu = cpu;
+		ring->tail++;
+	}
+	spin_unlock(&ring->lock);
+
+	put_cpu();
+}
+
+/*
+ * Allocates a ring per possible CPU, the first time the capture starts
+ */
+static int _allocRings(void) {
+	int cpu;
+
+	if (ringsAllocated) {
+		return 0;
+	}
+
+	rings = (sessionTraceRing*) kzalloc(nr_cpu_ids * sizeof(sessionTraceRing),
+	GFP_KERNEL);
+	if (rings == NULL ) {
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		spin_lock_init(&rings[cpu].lock);
+		rings[cpu].events = (struct sessionTraceEvent*) vmalloc_node(
+				ringEvents * sizeof(struct sessionTraceEvent), cpu_to_node(cpu));
+		if (rings[cpu].events == NULL ) {
+			goto fail;
+		}
+	}
+
+	// The rings must be visible before the recorders use them
+	smp_wmb();
+	ringsAllocated = 1;
+	return 0;
+
+fail:
+	for_each_possible_cpu(cpu) {
+		vfree(rings[cpu].events);
+	}
+	kfree(rings);
+	rings = NULL;
+	return -ENOMEM;
+}
+
+/*
+ * Writing 1 starts the capture, 0 stops it
+ */
+static ssize_t _traceEnableWrite(struct file *filePtr, const char __user *buff,
+		size_t count, loff_t *pos) {
+	int enable;
+	int ret;
+
+	ret = kstrtoint_from_user(buff, count, 0, &enable);
+	if (ret < 0) {
+		return ret;
+	}
+
+	mutex_lock(&traceLock);
+	if (enable) {
+		ret = _allocRings();
+	}
+	if (ret == 0) {
+		sessionTraceEnabled = (enable != 0);
+	}
+	mutex_unlock(&traceLock);
+
+	return ret < 0 ? ret : count;
+}
+
+/*
+ * Reports whether the capture is running
+ */
+static ssize_t _traceEnableRead(struct file *filePtr, char __user *buff,
+		size_t count, loff_t *pos) {
+	char report[4];
+	int length;
+
+	length = scnprintf(report, sizeof(report), "%d\n", sessionTraceEnabled);
+	return simple_read_from_buffer(buff, count, pos, report, length);
+}
+
+/*
+ * Drains the captured events, CPU by CPU, as an array of struct sessionTraceEvent. Only whole events are
+ * returned, and 0 once every ring is empty. The events of a CPU are in time order, the events of different
+ * CPUs must be merged by timestamp
+ */
+static ssize_t _traceRead(struct file *filePtr, char __user *buff,
+		size_t count, loff_t *pos) {
+	struct sessionTraceEvent *chunk;
+	sessionTraceRing *ring;
+	unsigned long available;
+	unsigned long taken;
+	unsigned long i;
+	ssize_t copied = 0;
+	int cpu;
+
+	chunk = kmalloc(DRAIN_CHUNK * sizeof(struct sessionTraceEvent), GFP_KERNEL);
+	if (chunk == NULL ) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&traceLock);
+	if (!ringsAllocated) {
+		goto out;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ring = &rings[cpu];
+		for (;;) {
+			available = (count - copied) / sizeof(struct sessionTraceEvent);
+			if (available == 0) {
+				goto out;
+			}
+
+			// Copies to the user buffer can fault, hence they are done out of the ring lock
+			spin_lock(&ring->lock);
+			taken = min(ring->tail - ring->head,
+					min(available, (unsigned long) DRAIN_CHUNK));
+			for (i = 0; i < taken; i++) {
+				chunk[i] = ring->events[(ring->head + i) % ringEvents];
+			}
+			ring->head += taken;
+			spin_unlock(&ring->lock);
+
+			if (taken == 0) {
+				break;
+			}
+			if (copy_to_user(&buff[copied], chunk,
+					taken * sizeof(struct sessionTraceEvent))) {
+				if (copied == 0) {
+					copied = -EFAULT;
+				}
+				goto out;
+			}
+			copied += taken * sizeof(struct sessionTraceEvent);
+		}
+	}
+
+out:
+	mutex_unlock(&traceLock);
+	kfree(chunk);
+	return copied;
+}
+
+/*
+ * Reports the number of events dropped because a ring was full
+ */
+static ssize_t _traceLostRead(struct file *filePtr, char __user *buff,
+		size_t count, loff_t *pos) {
+	char report[24];
+	unsigned long lost = 0;
+	int length;
+	int cpu;
+
+	mutex_lock(&traceLock);
+	if (ringsAllocated) {
+		for_each_possible_cpu(cpu) {
+			lost += ACCESS_ONCE(rings[cpu].lost);
+		}
+	}
+	mutex_unlock(&traceLock);
+
+	length = scnprintf(report, sizeof(report), "%lu\n", lost);
+	return simple_read_from_buffer(buff, count, pos, report, length);
+}
+
+static const struct file_operations traceEnableFops = { owner : THIS_MODULE, read
+		: _traceEnableRead, write: _traceEnableWrite, };
+
+static const struct file_operations traceFops = { owner : THIS_MODULE, read
+		: _traceRead, };
+
+static const struct file_operations traceLostFops = { owner : THIS_MODULE, read
+		: _traceLostRead, };
+
+/*
+ * Creates the debugfs files of the capture, the rings are allocated when the capture starts
+ */
+int sessionTraceInit(void) {
+	if (ringEvents <= 0) {
+		ringEvents = DEFAULT_TRACEEVENTS;
+	}
+
+	traceDir = debugfs_create_dir("session", NULL);
+	if (IS_ERR_OR_NULL(traceDir)) {
+		// The capture is only an aid, the sessions work without it
+		printk(KERN_WARNING "Cannot create the session debugfs directory\n");
+		traceDir = NULL;
+		return 0;
+	}
+
+	debugfs_create_file("traceEnable", S_IRUSR | S_IWUSR, traceDir, NULL,
+			&traceEnableFops);
+	debugfs_create_file("trace", S_IRUSR, traceDir, NULL, &traceFops);
+	debugfs_create_file("traceLost", S_IRUSR, traceDir, NULL, &traceLostFops);
+	return 0;
+}
+
+/*
+ * Removes the debugfs files and frees the rings, called once no session exists anymore
+ */
+void sessionTraceExit(void) {
+	int cpu;
+
+	sessionTraceEnabled = 0;
+	debugfs_remove_recursive(traceDir);
+
+	if (ringsAllocated) {
+		for_each_possible_cpu(cpu) {
+			vfree(rings[cpu].events);
+		}
+		kfree(rings);
+		rings = NULL;
+		ringsAllocated = 0;
+	}
+}
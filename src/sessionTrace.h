@@ -0,0 +1,25 @@
+/*
+ ============================================================================
+ Name        : sessionTrace.h
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Declaration of the session trace capture
+ ============================================================================
+ */
+
+#ifndef SESSIONTRACE_H_
+#define SESSIONTRACE_H_
+
+#include <linux/types.h>
+
+extern int sessionTraceEnabled;
+
+int sessionTraceInit(void);
+void sessionTraceExit(void);
+u64 sessionTraceNewId(void);
+void sessionTraceRecord(int type, u64 session, loff_t offset,
+		unsigned int size, unsigned int mode);
+
+#endif /* SESSIONTRACE_H_ */
@@ -20,13 +20,19 @@
 
 #include "Defines.h"
 #include "sessionFileOperations.h"
+#include "sessionBatch.h"
 #include "asm.h"
 
 #define __NR_sys_open_placeHolder 31
 #define __NR_sys_open 5
+#define __NR_sys_ftruncate 93
+#define __NR_sys_ftruncate64 194
 
 static long previousSysCall_sys_open = 0x0;
 static long previous_placeHolder = 0x0;
+static long previousSysCall_sessionOpenBatch = 0x0;
+static long previousSysCall_sys_ftruncate = 0x0;
+static long previousSysCall_sys_ftruncate64 = 0x0;
 extern void *sys_call_table[];
 
 extern asmlinkage long sys_close(unsigned int fd);
@@ -35,7 +41,7 @@ extern asmlinkage long sys_close(unsigned int fd);
  * Session Open Syscall implementation, call the original open and then calls the sessionOpen
  * function which will create a new session if required
  */
-asmlinkage int sys_sessionOpen(const char *pathname, int flags, mode_t mode) {
+asmlinkage int sys_sessionOpen(const char *pathname, int flags, int mode) {
 
 	int fd;
 	int ret;
@@ -43,8 +49,9 @@ asmlinkage int sys_sessionOpen(const char *pathname, int flags, mode_t mode) {
 
 	try_module_get(THIS_MODULE);
 
-	// Calling the original Open Syscall
-	fd = stub_syscall3(__NR_sys_open_placeHolder, (long) pathname, flags, mode);
+	// Calling the original Open Syscall, a truncation is deferred to the commit of the session
+	fd = stub_syscall3(__NR_sys_open_placeHolder, (long) pathname,
+			sessionRealOpenFlags(flags), mode);
 
 	if (fd < 0) {
 		module_put(THIS_MODULE);
@@ -55,7 +62,7 @@ asmlinkage int sys_sessionOpen(const char *pathname, int flags, mode_t mode) {
 	filePtr = fget(fd);
 	// Reducing the f_count field
 	atomic_long_dec(&filePtr->f_count);
-	ret = sessionOpen(filePtr, flags);
+	ret = sessionOpen(filePtr, flags, mode);
 	if(ret < 0){
 		// If a failure occurred, close the file
 		sys_close(fd);
@@ -67,17 +74,91 @@ asmlinkage int sys_sessionOpen(const char *pathname, int flags, mode_t mode) {
 	return fd;
 }
 
+/*
+ * Calls the original Open Syscall through its placeholder
+ */
+static long _originalOpen(const char __user *pathname, int flags, int mode) {
+	return stub_syscall3(__NR_sys_open_placeHolder, (long) pathname, flags, mode);
+}
+
+/*
+ * Batched Session Open Syscall implementation, opens all the requested files as sessions or none
+ */
+asmlinkage long sys_sessionOpenBatch(struct sessionOpenRequest __user *requests, int count) {
+	long ret;
+
+	try_module_get(THIS_MODULE);
+	ret = sessionOpenBatch(requests, count, _originalOpen);
+	module_put(THIS_MODULE);
+
+	return ret;
+}
+
+/*
+ * Ftruncate Syscall replacement: on session files it changes the size of the session file only, otherwise
+ * it calls the original ftruncate
+ */
+asmlinkage long sys_sessionFtruncate(unsigned int fd, unsigned long length) {
+	struct file *filePtr;
+	long ret;
+
+	filePtr = fget(fd);
+	if (filePtr != NULL && sessionIsSession(filePtr)) {
+		ret = sessionTruncate(filePtr, length);
+		fput(filePtr);
+		return ret;
+	}
+	if (filePtr != NULL ) {
+		fput(filePtr);
+	}
+
+	return ((asmlinkage long (*)(unsigned int, unsigned long)) previousSysCall_sys_ftruncate)(
+			fd, length);
+}
+
+/*
+ * Ftruncate64 Syscall replacement, same as sys_sessionFtruncate
+ */
+asmlinkage long sys_sessionFtruncate64(unsigned int fd, loff_t length) {
+	struct file *filePtr;
+	long ret;
+
+	filePtr = fget(fd);
+	if (filePtr != NULL && sessionIsSession(filePtr)) {
+		ret = sessionTruncate(filePtr, length);
+		fput(filePtr);
+		return ret;
+	}
+	if (filePtr != NULL ) {
+		fput(filePtr);
+	}
+
+	return ((asmlinkage long (*)(unsigned int, loff_t)) previousSysCall_sys_ftruncate64)(
+			fd, length);
+}
+
 /*
  * Initialize the session module and switches the syscall places on the system call table
  */
-int registerSessionSyscall(int maxSession, int bufferOrder) {
+int registerSessionSyscall(int maxSession, int bufferOrder, int bufferPolicy,
+		int poolSize) {
+	int ret;
 
-	sessionInit(maxSession, bufferOrder);
+	ret = sessionInit(maxSession, bufferOrder, bufferPolicy, poolSize);
+	if (ret < 0) {
+		return ret;
+	}
 
 	previousSysCall_sys_open = (long) sys_call_table[__NR_sys_open];
 	sys_call_table[__NR_sys_open] = sys_sessionOpen;
 	previous_placeHolder = (long)  sys_call_table[__NR_sys_open_placeHolder];
 	sys_call_table[__NR_sys_open_placeHolder] = (void*) previousSysCall_sys_open;
+	previousSysCall_sessionOpenBatch = (long) sys_call_table[__NR_sessionOpenBatch];
+	sys_call_table[__NR_sessionOpenBatch] = sys_sessionOpenBatch;
+	previousSysCall_sys_ftruncate = (long) sys_call_table[__NR_sys_ftruncate];
+	sys_call_table[__NR_sys_ftruncate] = sys_sessionFtruncate;
+	previousSysCall_sys_ftruncate64 = (long) sys_call_table[__NR_sys_ftruncate64];
+	sys_call_table[__NR_sys_ftruncate64] = sys_sessionFtruncate64;
 	return 0;
 }
 
@@ -87,6 +168,11 @@ int registerSessionSyscall(int maxSession, int bufferOrder) {
 int unregisterSessionSyscall(void) {
 	sys_call_table[__NR_sys_open] = (void*) previousSysCall_sys_open;
 	sys_call_table[__NR_sys_open_placeHolder] = (void*) previous_placeHolder;
+	sys_call_table[__NR_sessionOpenBatch] = (void*) previousSysCall_sessionOpenBatch;
+	sys_call_table[__NR_sys_ftruncate] = (void*) previousSysCall_sys_ftruncate;
+	sys_call_table[__NR_sys_ftruncate64] = (void*) previousSysCall_sys_ftruncate64;
+
+	sessionExit();
 	return 0;
 }
 
@@ -13,7 +13,8 @@
 #ifndef SESSIONSYSCALL_H_
 #define	 SESSIONSYSCALL_H_
 
-int registerSessionSyscall(int maxSession, int bufferOrder);
+int registerSessionSyscall(int maxSession, int bufferOrder, int bufferPolicy,
+		int poolSize);
 int unregisterSessionSyscall(void);
 
 #endif /* SESSIONSYSCALL_H_ */
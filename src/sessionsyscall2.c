@@ -23,22 +23,28 @@
 
 #include "Defines.h"
 #include "sessionFileOperations.h"
+#include "sessionBatch.h"
 #include "syscallStealing.h"
 
 #define __NR_sys_open 5
+#define __NR_sys_ftruncate 93
+#define __NR_sys_ftruncate64 194
 
 static long *previousSysCall_sys_open = 0x0;
+static long *previousSysCall_sessionOpenBatch = 0x0;
+static long *previousSysCall_sys_ftruncate = 0x0;
+static long *previousSysCall_sys_ftruncate64 = 0x0;
 unsigned long **sys_call_table_stealed;
 
 // Prototype of the original open syscall
-asmlinkage int (*original_open) (const char *, int, mode_t);
+asmlinkage int (*original_open) (const char *, int, int);
 extern asmlinkage long sys_close(unsigned int fd);
 
 /*
  * Session Open Syscall implementation, call the original open and then calls the sessionOpen
  * function which will create a new session if required
  */
-asmlinkage int sys_sessionOpen(const char *pathname, int flags, mode_t mode) {
+asmlinkage int sys_sessionOpen(const char *pathname, int flags, int mode) {
 
 	int fd;
 	int ret;
@@ -47,7 +53,7 @@ asmlinkage int sys_sessionOpen(const char *pathname, int flags, mode_t mode) {
 	try_module_get(THIS_MODULE);
 
 	// Calling the original Open Syscall
-	fd = original_open(pathname, flags, mode);
+	fd = original_open(pathname, sessionRealOpenFlags(flags), mode);
 
 	if (fd < 0) {
 		module_put(THIS_MODULE);
@@ -58,7 +64,7 @@ asmlinkage int sys_sessionOpen(const char *pathname, int flags, mode_t mode) {
 	filePtr = fget(fd);
 	// Reducing the f_count field
 	atomic_long_dec(&filePtr->f_count);
-	ret = sessionOpen(filePtr, flags);
+	ret = sessionOpen(filePtr, flags, mode);
 	if(ret < 0){
 		// If a failure occurred, close the file
 		sys_close(fd);
@@ -70,26 +76,100 @@ asmlinkage int sys_sessionOpen(const char *pathname, int flags, mode_t mode) {
 	return fd;
 }
 
+/*
+ * Calls the original Open Syscall through the saved function pointer
+ */
+static long _originalOpen(const char __user *pathname, int flags, int mode) {
+	return original_open(pathname, flags, mode);
+}
+
+/*
+ * Batched Session Open Syscall implementation, opens all the requested files as sessions or none
+ */
+asmlinkage long sys_sessionOpenBatch(struct sessionOpenRequest __user *requests, int count) {
+	long ret;
+
+	try_module_get(THIS_MODULE);
+	ret = sessionOpenBatch(requests, count, _originalOpen);
+	module_put(THIS_MODULE);
+
+	return ret;
+}
+
+/*
+ * Ftruncate Syscall replacement: on session files it changes the size of the session file only, otherwise
+ * it calls the original ftruncate
+ */
+asmlinkage long sys_sessionFtruncate(unsigned int fd, unsigned long length) {
+	struct file *filePtr;
+	long ret;
+
+	filePtr = fget(fd);
+	if (filePtr != NULL && sessionIsSession(filePtr)) {
+		ret = sessionTruncate(filePtr, length);
+		fput(filePtr);
+		return ret;
+	}
+	if (filePtr != NULL ) {
+		fput(filePtr);
+	}
+
+	return ((asmlinkage long (*)(unsigned int, unsigned long)) previousSysCall_sys_ftruncate)(
+			fd, length);
+}
+
+/*
+ * Ftruncate64 Syscall replacement, same as sys_sessionFtruncate
+ */
+asmlinkage long sys_sessionFtruncate64(unsigned int fd, loff_t length) {
+	struct file *filePtr;
+	long ret;
+
+	filePtr = fget(fd);
+	if (filePtr != NULL && sessionIsSession(filePtr)) {
+		ret = sessionTruncate(filePtr, length);
+		fput(filePtr);
+		return ret;
+	}
+	if (filePtr != NULL ) {
+		fput(filePtr);
+	}
+
+	return ((asmlinkage long (*)(unsigned int, loff_t)) previousSysCall_sys_ftruncate64)(
+			fd, length);
+}
+
 /*
  * Initialize the session module and switches the syscall places on the system call table
  */
-int registerSessionSyscall(int maxSession, int bufferOrder) {
+int registerSessionSyscall(int maxSession, int bufferOrder, int bufferPolicy,
+		int poolSize) {
+	int ret;
 
 	if(getSystemCallTableAddr(&sys_call_table_stealed) < 0){
 		printk(KERN_ERR "Cannot retrieve sys call table address");
 		return -1;
 	}
 
-	sessionInit(maxSession, bufferOrder);
+	ret = sessionInit(maxSession, bufferOrder, bufferPolicy, poolSize);
+	if (ret < 0) {
+		return ret;
+	}
 
 	// Store the original open into our function pointer, allowing efficient call
-	original_open = (asmlinkage int (*) (const char *, int, mode_t)) sys_call_table_stealed[__NR_sys_open];
+	original_open = (asmlinkage int (*) (const char *, int, int)) sys_call_table_stealed[__NR_sys_open];
 
 	// Disable the read only protection
 	disable_page_protection();
 
 	previousSysCall_sys_open = sys_call_table_stealed[__NR_sys_open];
 	sys_call_table_stealed[__NR_sys_open] = (unsigned long *) sys_sessionOpen;
+	previousSysCall_sessionOpenBatch = sys_call_table_stealed[__NR_sessionOpenBatch];
+	sys_call_table_stealed[__NR_sessionOpenBatch] = (unsigned long *) sys_sessionOpenBatch;
+	previousSysCall_sys_ftruncate = sys_call_table_stealed[__NR_sys_ftruncate];
+	sys_call_table_stealed[__NR_sys_ftruncate] = (unsigned long *) sys_sessionFtruncate;
+	previousSysCall_sys_ftruncate64 = sys_call_table_stealed[__NR_sys_ftruncate64];
+	sys_call_table_stealed[__NR_sys_ftruncate64] = (unsigned long *) sys_sessionFtruncate64;
 
 	// Re enable the read only protection
 	enable_page_protection();
@@ -106,9 +186,14 @@ int unregisterSessionSyscall(void) {
 	disable_page_protection();
 
 	sys_call_table_stealed[__NR_sys_open] = previousSysCall_sys_open;
+	sys_call_table_stealed[__NR_sessionOpenBatch] = previousSysCall_sessionOpenBatch;
+	sys_call_table_stealed[__NR_sys_ftruncate] = previousSysCall_sys_ftruncate;
+	sys_call_table_stealed[__NR_sys_ftruncate64] = previousSysCall_sys_ftruncate64;
 
 	// Re enable the read only protection
 	enable_page_protection();
+
+	sessionExit();
 	return 0;
 }
 
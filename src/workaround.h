@@ -21,6 +21,16 @@
 #include <asm/uaccess.h>
 #include <linux/file.h>
 #include <linux/gfp.h>
+#include <linux/cred.h>
+#include <linux/mount.h>
+#include <linux/dcache.h>
+
+#include "sessionCompat.h"
+
+#ifndef SESSION_HAVE_ITER
+extern int kernel_read(struct file * filePtr, loff_t offset, char* addr,
+unsigned long count);
+#endif
 
 /*
  * Increments the atomic counter only if the current value is not threshold
@@ -44,6 +54,29 @@ inline int _atomicIncUnless(atomic_t *v, int threshold){
 	return currentValue;
 }
 
+/*
+ * Adds amount to the atomic counter only if the result does not exceed threshold
+ * Returns the previous value, or -1 if the counter has not been changed
+ */
+inline int _atomicAddUnlessExceeds(atomic_t *v, int amount, int threshold){
+	int currentValue, previousValue;
+	// Reads the current value
+	currentValue = atomic_read(v);
+	for (;;) {
+		// If the new value would exceed the threshold, return
+		if (unlikely(currentValue + amount > threshold))
+			return -1;
+		// Try to compare and swap currentValue with currentValue+amount, returns the read value in previousValue
+		previousValue = atomic_cmpxchg((v), currentValue, currentValue + amount);
+		// If the value has not been changed by someone else, return
+		if (likely(previousValue == currentValue))
+			break;
+		// If the value has been changed by someone else, try again
+		currentValue = previousValue;
+	}
+	return currentValue;
+}
+
 /*
  * ORs the current value with the bitMask if it has not been done already
  */
@@ -94,6 +127,9 @@ inline int _atomicIncUnlessSet(atomic_t *v, int bitMask){
  */
 ssize_t _writeSessionBufferToFile(struct file *file, const char *buf,
 		size_t count, loff_t pos) {
+#ifdef SESSION_HAVE_ITER
+	return kernel_write(file, buf, count, &pos);
+#else
 	mm_segment_t old_fs;
 	ssize_t res;
 
@@ -104,8 +140,23 @@ ssize_t _writeSessionBufferToFile(struct file *file, const char *buf,
 	set_fs(old_fs);
 
 	return res;
+#endif
+}
+
+/*
+ * Reads count bytes of the file at offset in a kernel buffer, hiding the kernel_read signature change
+ */
+ssize_t _readFileToBuffer(struct file *file, loff_t offset, char *buf,
+		unsigned long count) {
+#ifdef SESSION_HAVE_ITER
+	return kernel_read(file, buf, count, &offset);
+#else
+	return kernel_read(file, offset, buf, count);
+#endif
 }
 
+#ifndef SESSION_HAVE_ITER
+
 /*
  * Mimics the do_truncate function which symbol is not exported
  */
@@ -136,6 +187,34 @@ int _doTruncate(struct dentry *dentry, loff_t length, unsigned int time_attrs,
 	mutex_unlock(&dentry->d_inode->i_mutex);
 	return ret;
 }
+#endif
+
+/*
+ * Truncates the file to length, current kernels export vfs_truncate
+ */
+int _truncateFile(struct file *file, loff_t length) {
+#ifdef SESSION_HAVE_ITER
+	return vfs_truncate(&file->f_path, length);
+#else
+	return _doTruncate(file->f_dentry, length, 0, NULL );
+#endif
+}
+
+/*
+ * Opens for writing a second file on the same path. Unlike the session file it keeps the original file
+ * operations, hence it can write back the session while the session goes on. The file is flagged with
+ * O_SESSION, which dentry_open keeps, so that the hook on the opens knows it for a session write back
+ */
+struct file* _openFileForWrite(struct file *file) {
+#ifdef SESSION_HAVE_ITER
+	return dentry_open(&file->f_path, O_WRONLY | O_LARGEFILE | O_SESSION,
+			current_cred());
+#else
+	// dentry_open takes over the references, even on failure
+	return dentry_open(dget(file->f_path.dentry), mntget(file->f_path.mnt),
+			O_WRONLY | O_LARGEFILE | O_SESSION, current_cred());
+#endif
+}
 
 /*
  * Mimics the usigned_offset function which is required by the lseek_execute
@@ -150,6 +229,9 @@ static inline int _unsignedOffsets(struct file *file)
  */
 loff_t _lseekExecute(struct file *file, loff_t offset, loff_t maxsize)
 {
+#ifdef SESSION_HAVE_ITER
+	return vfs_setpos(file, offset, maxsize);
+#else
 	if (offset < 0 && !_unsignedOffsets(file))
 		return -EINVAL;
 	if (offset > maxsize)
@@ -160,6 +242,7 @@ loff_t _lseekExecute(struct file *file, loff_t offset, loff_t maxsize)
 		file->f_version = 0;
 	}
 	return offset;
+#endif
 }
 
 #endif /* WORKAROUND_H_ */
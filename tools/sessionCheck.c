@@ -0,0 +1,232 @@
+/*
+ ============================================================================
+ Name        : sessionCheck.c
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Checks the session semantics against the session module, on
+ 	 scratch files in the given directory. Every check prints its outcome,
+ 	 the exit status is the number of failed checks. The checks of the
+ 	 batched session open are skipped with -n
+ 	 Usage: sessionCheck [-n] [-d directory]
+ ============================================================================
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "Defines.h"
+
+#define CHECK_SIZE 4096 // Size of the scratch files
+#define PATTERN 0x5a // Byte the scratch files are filled with
+
+static const char *directory = "."; // Directory of the scratch files
+
+/*
+ * Builds the path of the scratch file called name
+ */
+static void _scratchPath(char *path, size_t size, const char *name) {
+	snprintf(path, size, "%s/%s", directory, name);
+}
+
+/*
+ * Creates the scratch file at path, filled with the pattern. Returns 0 on success
+ */
+static int _scratchCreate(const char *path) {
+	char buffer[CHECK_SIZE];
+	int fd;
+	int ret = 0;
+
+	memset(buffer, PATTERN, CHECK_SIZE);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (write(fd, buffer, CHECK_SIZE) != CHECK_SIZE) {
+		perror(path);
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
+/*
+ * Returns 1 if the scratch file at path still holds just the pattern it was created with
+ */
+static int _scratchUnchanged(const char *path) {
+	char buffer[CHECK_SIZE + 1];
+	ssize_t length;
+	ssize_t i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 0;
+	}
+	length = read(fd, buffer, CHECK_SIZE + 1);
+	close(fd);
+	if (length != CHECK_SIZE) {
+		return 0;
+	}
+	for (i = 0; i < length; i++) {
+		if (buffer[i] != PATTERN) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Issues a batched session open: on the control device on the ftrace build, otherwise through the syscall
+ */
+static long _openBatch(struct sessionOpenRequest *requests, int count) {
+	struct sessionBatchRequest batch;
+	long ret;
+	int control;
+	int error;
+
+	control = open(SESSION_CONTROL_DEVICE, O_RDONLY);
+	if (control < 0) {
+		return syscall(__NR_sessionOpenBatch, requests, count);
+	}
+
+	batch.requests = requests;
+	batch.count = count;
+	ret = ioctl(control, SESSION_IOC_OPEN_BATCH, &batch);
+	error = errno;
+	close(control);
+	errno = error;
+	return ret;
+}
+
+/*
+ * A batched open failing after its sessions have been created must write none of them back: the
+ * request array is read only, so the module fails with EFAULT when it copies the descriptors out
+ */
+static int _checkBatchRollback(void) {
+	struct sessionOpenRequest *requests;
+	char truncPath[PATH_MAX];
+	char plainPath[PATH_MAX];
+	long ret;
+	int passed;
+
+	_scratchPath(truncPath, sizeof(truncPath), "sessionCheck.trunc");
+	_scratchPath(plainPath, sizeof(plainPath), "sessionCheck.plain");
+	if (_scratchCreate(truncPath) < 0 || _scratchCreate(plainPath) < 0) {
+		return 0;
+	}
+
+	requests = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (requests == MAP_FAILED) {
+		perror("mmap");
+		return 0;
+	}
+	requests[0].pathname = truncPath;
+	requests[0].flags = O_RDWR | O_TRUNC;
+	requests[0].mode = 0;
+	requests[0].fd = -1;
+	requests[1].pathname = plainPath;
+	requests[1].flags = O_RDWR;
+	requests[1].mode = 0;
+	requests[1].fd = -1;
+	mprotect(requests, getpagesize(), PROT_READ);
+
+	ret = _openBatch(requests, 2);
+	passed = ret < 0 && errno == EFAULT && _scratchUnchanged(truncPath)
+			&& _scratchUnchanged(plainPath);
+
+	munmap(requests, getpagesize());
+	unlink(truncPath);
+	unlink(plainPath);
+	return passed;
+}
+
+/*
+ * A commit after an abort must fail and write nothing back, neither then nor on close
+ */
+static int _checkAbortCommit(void) {
+	char path[PATH_MAX];
+	char buffer[CHECK_SIZE];
+	int fd;
+	int passed;
+
+	_scratchPath(path, sizeof(path), "sessionCheck.abort");
+	if (_scratchCreate(path) < 0) {
+		return 0;
+	}
+
+	fd = open(path, O_RDWR | O_SESSION);
+	if (fd < 0) {
+		perror(path);
+		unlink(path);
+		return 0;
+	}
+	memset(buffer, ~PATTERN, CHECK_SIZE);
+	passed = write(fd, buffer, CHECK_SIZE) == CHECK_SIZE
+			&& ioctl(fd, SESSION_IOC_ABORT) == 0
+			&& ioctl(fd, SESSION_IOC_COMMIT) < 0 && errno == ECANCELED
+			&& _scratchUnchanged(path);
+	passed = close(fd) == 0 && passed && _scratchUnchanged(path);
+
+	unlink(path);
+	return passed;
+}
+
+// A check of the session semantics, returning 1 if it passed
+struct sessionCheck {
+	const char *name;
+	int (*check)(void);
+	int batch; // Set if the check needs the batched session open
+};
+
+static const struct sessionCheck checks[] = {
+	{ "failed batch leaves its files unchanged", _checkBatchRollback, 1 },
+	{ "commit after abort fails and writes nothing", _checkAbortCommit, 0 },
+};
+
+int main(int argc, char *argv[]) {
+	int skipBatch = 0;
+	int failed = 0;
+	size_t i;
+	int option;
+
+	while ((option = getopt(argc, argv, "nd:")) != -1) {
+		switch (option) {
+		case 'n':
+			skipBatch = 1;
+			break;
+		case 'd':
+			directory = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n] [-d directory]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		if (checks[i].batch && skipBatch) {
+			printf("SKIP %s\n", checks[i].name);
+		} else if (checks[i].check()) {
+			printf("PASS %s\n", checks[i].name);
+		} else {
+			printf("FAIL %s\n", checks[i].name);
+			failed++;
+		}
+	}
+	return failed;
+}
@@ -0,0 +1,420 @@
+/*
+ ============================================================================
+ Name        : sessionReplay.c
+ Author      : agent
+ Created on  : Oct 19, 2026
+ Version     : 1.0
+ Copyright   : Copyright (c) 2026  agent
+ Description : Replays a session trace drained from /sys/kernel/debug/session/trace
+ 	 against the session module. Every traced thread is replayed by its own
+ 	 thread, and every event is issued at its original time from the start of
+ 	 the trace, divided by the speedup. Each traced session is replayed on a
+ 	 scratch file of the traced size, written with a fixed pattern
+ 	 Usage: sessionReplay [-s speedup] [-d directory] trace
+ ============================================================================
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "Defines.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define PATTERN 0x5a // Byte written by the replayed writes
+
+// Replayed session, the descriptor is published by the thread replaying the open
+struct replaySession {
+	unsigned long long id; // Identifier of the session in the trace
+	int fd; // Descriptor of the replayed session, -1 until opened
+	int closed; // Set once the session has been released
+};
+
+// Events of a traced thread, in time order
+struct replayThread {
+	pthread_t thread;
+	int pid; // Traced thread
+	struct sessionTraceEvent **events;
+	int count;
+	int size;
+	unsigned long long issued; // Replayed operations
+	unsigned long long failed; // Replayed operations that returned an error
+	unsigned long long late; // Operations issued after their time
+};
+
+static struct replaySession *sessions = NULL; // Sorted by identifier
+static int sessionCount = 0;
+static pthread_mutex_t sessionLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessionOpened = PTHREAD_COND_INITIALIZER;
+
+static const char *directory = "."; // Directory of the scratch files
+static double speedup = 1.0;
+static unsigned long long firstTimestamp; // Time of the first traced event
+static struct timespec start; // Time the replay started
+
+/*
+ * Orders the events by time, the events drained from different CPUs are merged this way
+ */
+static int _compareEvents(const void *a, const void *b) {
+	const struct sessionTraceEvent *first = a;
+	const struct sessionTraceEvent *second = b;
+
+	if (first->timestamp != second->timestamp) {
+		return first->timestamp < second->timestamp ? -1 : 1;
+	}
+	return 0;
+}
+
+static int _compareSessions(const void *a, const void *b) {
+	const struct replaySession *first = a;
+	const struct replaySession *second = b;
+
+	if (first->id != second->id) {
+		return first->id < second->id ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Returns the replayed session with the given identifier, NULL if its open has not been traced
+ */
+static struct replaySession* _findSession(unsigned long long id) {
+	struct replaySession key;
+
+	key.id = id;
+	return bsearch(&key, sessions, sessionCount, sizeof(struct replaySession),
+			_compareSessions);
+}
+
+/*
+ * Returns the descriptor of the session, waiting for the thread replaying its open. Returns -1 if
+ * the open failed or the session is gone
+ */
+static int _sessionFd(struct replaySession *session) {
+	int fd;
+
+	pthread_mutex_lock(&sessionLock);
+	while (session->fd == -1 && !session->closed) {
+		pthread_cond_wait(&sessionOpened, &sessionLock);
+	}
+	fd = session->closed ? -1 : session->fd;
+	pthread_mutex_unlock(&sessionLock);
+	return fd;
+}
+
+/*
+ * Publishes the outcome of the open of a session, a failed open is published as closed
+ */
+static void _publishSession(struct replaySession *session, int fd) {
+	pthread_mutex_lock(&sessionLock);
+	session->fd = fd;
+	session->closed = (fd < 0);
+	pthread_cond_broadcast(&sessionOpened);
+	pthread_mutex_unlock(&sessionLock);
+}
+
+/*
+ * Sleeps until the time of the event, scaled by the speedup. Returns 1 if the time had already passed
+ */
+static int _waitFor(struct sessionTraceEvent *event) {
+	unsigned long long delay;
+	struct timespec now;
+	struct timespec when;
+
+	delay = (unsigned long long) ((event->timestamp - firstTimestamp) / speedup);
+	when.tv_sec = start.tv_sec + delay / NSEC_PER_SEC;
+	when.tv_nsec = start.tv_nsec + delay % NSEC_PER_SEC;
+	if (when.tv_nsec >= (long) NSEC_PER_SEC) {
+		when.tv_sec++;
+		when.tv_nsec -= NSEC_PER_SEC;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > when.tv_sec
+			|| (now.tv_sec == when.tv_sec && now.tv_nsec > when.tv_nsec)) {
+		return 1;
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL)
+			== EINTR)
+		;
+	return 0;
+}
+
+/*
+ * Creates the scratch file of a session with the traced size, and opens it with session semantics
+ */
+static int _replayOpen(struct sessionTraceEvent *event) {
+	char path[4096];
+	char *contents;
+	int flags;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/session-%llu", directory, event->session);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	contents = malloc(event->offset > 0 ? event->offset : 1);
+	if (contents == NULL) {
+		close(fd);
+		return -1;
+	}
+	memset(contents, PATTERN, event->offset);
+	if (pwrite(fd, contents, event->offset, 0) != event->offset) {
+		free(contents);
+		close(fd);
+		return -1;
+	}
+	free(contents);
+	close(fd);
+
+	// The scratch file exists already, it must not be created again
+	flags = (event->size & ~(O_CREAT | O_EXCL)) | O_SESSION;
+	return open(path, flags, event->mode);
+}
+
+/*
+ * Replays the events of a traced thread
+ */
+static void* _replayThread(void *arg) {
+	struct replayThread *thread = arg;
+	struct sessionTraceEvent *event;
+	struct replaySession *session;
+	char *buffer = NULL;
+	size_t bufferSize = 0;
+	ssize_t ret;
+	int fd;
+	int i;
+
+	for (i = 0; i < thread->count; i++) {
+		event = thread->events[i];
+		session = _findSession(event->session);
+		if (session == NULL) {
+			// Opened while the capture was stopped, or its open has been dropped
+			continue;
+		}
+
+		thread->late += _waitFor(event);
+
+		if (event->type == SESSION_TRACE_OPEN) {
+			fd = _replayOpen(event);
+			_publishSession(session, fd);
+			thread->issued++;
+			thread->failed += (fd < 0);
+			continue;
+		}
+
+		// A flush is a close of a shared descriptor, the replay closes the session on its release only
+		if (event->type == SESSION_TRACE_FLUSH) {
+			continue;
+		}
+
+		fd = _sessionFd(session);
+		if (fd < 0) {
+			continue;
+		}
+
+		if ((event->type == SESSION_TRACE_READ
+				|| event->type == SESSION_TRACE_WRITE)
+				&& event->size > bufferSize) {
+			free(buffer);
+			bufferSize = event->size;
+			buffer = malloc(bufferSize);
+			if (buffer == NULL) {
+				fprintf(stderr, "Cannot allocate %zu bytes\n", bufferSize);
+				exit(EXIT_FAILURE);
+			}
+			memset(buffer, PATTERN, bufferSize);
+		}
+
+		switch (event->type) {
+		case SESSION_TRACE_READ:
+			ret = pread(fd, buffer, event->size, event->offset);
+			break;
+		case SESSION_TRACE_WRITE:
+			ret = pwrite(fd, buffer, event->size, event->offset);
+			break;
+		case SESSION_TRACE_LLSEEK:
+			ret = lseek(fd, event->offset, event->size);
+			break;
+		case SESSION_TRACE_RELEASE:
+			pthread_mutex_lock(&sessionLock);
+			session->closed = 1;
+			pthread_mutex_unlock(&sessionLock);
+			ret = close(fd);
+			break;
+		default:
+			continue;
+		}
+
+		thread->issued++;
+		thread->failed += (ret < 0);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * Returns the replay thread of the traced thread, adding it if needed
+ */
+static struct replayThread* _threadFor(struct replayThread **threads,
+		int *threadCount, int pid) {
+	struct replayThread *thread;
+	int i;
+
+	for (i = 0; i < *threadCount; i++) {
+		if ((*threads)[i].pid == pid) {
+			return &(*threads)[i];
+		}
+	}
+
+	*threads = realloc(*threads, (*threadCount + 1) * sizeof(struct replayThread));
+	if (*threads == NULL) {
+		fprintf(stderr, "Cannot allocate the replay threads\n");
+		exit(EXIT_FAILURE);
+	}
+	thread = &(*threads)[(*threadCount)++];
+	memset(thread, 0, sizeof(struct replayThread));
+	thread->pid = pid;
+	return thread;
+}
+
+/*
+ * Reads the whole trace, returns the number of events
+ */
+static long _readTrace(const char *path, struct sessionTraceEvent **events) {
+	struct stat info;
+	FILE *trace;
+	long count;
+
+	trace = fopen(path, "rb");
+	if (trace == NULL || fstat(fileno(trace), &info) < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	count = info.st_size / sizeof(struct sessionTraceEvent);
+	*events = malloc((count > 0 ? count : 1) * sizeof(struct sessionTraceEvent));
+	if (*events == NULL
+			|| fread(*events, sizeof(struct sessionTraceEvent), count, trace)
+					!= (size_t) count) {
+		fprintf(stderr, "Cannot read %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	fclose(trace);
+	return count;
+}
+
+int main(int argc, char *argv[]) {
+	struct sessionTraceEvent *events;
+	struct replayThread *threads = NULL;
+	struct replayThread *thread;
+	struct timespec end;
+	unsigned long long issued = 0, failed = 0, late = 0;
+	int threadCount = 0;
+	long count;
+	long i;
+	int option;
+
+	while ((option = getopt(argc, argv, "s:d:")) != -1) {
+		switch (option) {
+		case 's':
+			speedup = atof(optarg);
+			break;
+		case 'd':
+			directory = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || speedup <= 0) {
+		goto usage;
+	}
+
+	count = _readTrace(argv[optind], &events);
+	if (count == 0) {
+		printf("Empty trace\n");
+		return EXIT_SUCCESS;
+	}
+	qsort(events, count, sizeof(struct sessionTraceEvent), _compareEvents);
+	firstTimestamp = events[0].timestamp;
+
+	// The sessions whose open has been traced, the other events are skipped
+	sessions = malloc(count * sizeof(struct replaySession));
+	if (sessions == NULL) {
+		fprintf(stderr, "Cannot allocate the sessions\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < count; i++) {
+		if (events[i].type == SESSION_TRACE_OPEN) {
+			sessions[sessionCount].id = events[i].session;
+			sessions[sessionCount].fd = -1;
+			sessions[sessionCount].closed = 0;
+			sessionCount++;
+		}
+	}
+	qsort(sessions, sessionCount, sizeof(struct replaySession),
+			_compareSessions);
+
+	// Splits the events among the traced threads, keeping the time order
+	for (i = 0; i < count; i++) {
+		thread = _threadFor(&threads, &threadCount, events[i].pid);
+		if (thread->count == thread->size) {
+			thread->size = thread->size ? thread->size * 2 : 64;
+			thread->events = realloc(thread->events,
+					thread->size * sizeof(struct sessionTraceEvent*));
+			if (thread->events == NULL) {
+				fprintf(stderr, "Cannot allocate the thread events\n");
+				return EXIT_FAILURE;
+			}
+		}
+		thread->events[thread->count++] = &events[i];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threadCount; i++) {
+		if (pthread_create(&threads[i].thread, NULL, _replayThread, &threads[i])
+				!= 0) {
+			fprintf(stderr, "Cannot create the replay threads\n");
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < threadCount; i++) {
+		pthread_join(threads[i].thread, NULL);
+		issued += threads[i].issued;
+		failed += threads[i].failed;
+		late += threads[i].late;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// The sessions whose release has not been traced are still open
+	for (i = 0; i < sessionCount; i++) {
+		if (!sessions[i].closed && sessions[i].fd >= 0) {
+			close(sessions[i].fd);
+		}
+	}
+
+	printf("%ld events, %d sessions, %d threads\n", count, sessionCount,
+			threadCount);
+	printf("%llu operations replayed, %llu failed, %llu late\n", issued, failed,
+			late);
+	printf("Replay took %.6f s, the trace spans %.6f s\n",
+			(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+			(events[count - 1].timestamp - firstTimestamp) / 1e9);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-s speedup] [-d directory] trace\n", argv[0]);
+	return EXIT_FAILURE;
+}